@@ -0,0 +1,148 @@
+// Generated corpora for the benchmarks: a vocabulary whose words turn up with
+// Zipfian frequencies, like real text, and dictionaries and documents made
+// of them. Everything comes from a seeded PRNG, so a given size is the same
+// on every run and every machine.
+
+var Syllables = [];
+'bdfgklmnprstvz'.split('').forEach(function(c) {
+  'aeiou'.split('').forEach(function(v) { Syllables.push(c + v); });
+});
+
+// xorshift32: fast, and plenty random for this
+function Random(seed) {
+  this.state = (seed >>> 0) || 1;
+}
+
+Random.prototype.next = function() {
+  var x = this.state;
+  x ^= x << 13;
+  x ^= x >>> 17;
+  x ^= x << 5;
+  this.state = x >>> 0;
+  return this.state / 4294967296;
+};
+
+// The i'th word of the vocabulary: distinct for every i, and shortest for the
+// most frequent, as in real languages.
+function word(i) {
+  var ret = '';
+  do {
+    ret += Syllables[i % Syllables.length];
+    i = Math.floor(i / Syllables.length);
+  } while (i > 0);
+  return ret;
+}
+
+// Draws word ranks in [0, size) with P(rank) proportional to 1 / (rank + 1)^s
+function Zipf(size, s, random) {
+  this.random = random;
+  this.cdf = new Float64Array(size);
+  var total = 0;
+  for (var i = 0; i < size; i++) {
+    total += 1 / Math.pow(i + 1, s);
+    this.cdf[i] = total;
+  }
+  for (var i = 0; i < size; i++) this.cdf[i] /= total;
+}
+
+Zipf.prototype.next = function() {
+  var u = this.random.next();
+  var lo = 0, hi = this.cdf.length - 1;
+  while (lo < hi) {
+    var mid = (lo + hi) >>> 1;
+    if (this.cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+};
+
+// Writes Strings into one big Buffer, without building them all first
+function BufferWriter(capacity) {
+  this.buffer = Buffer.allocUnsafe(capacity);
+  this.length = 0;
+}
+
+BufferWriter.prototype.write = function(s) {
+  if (this.length + s.length * 3 > this.buffer.length) {
+    var bigger = Buffer.allocUnsafe(Math.max(this.buffer.length * 2, this.length + s.length * 3));
+    this.buffer.copy(bigger, 0, 0, this.length);
+    this.buffer = bigger;
+  }
+  this.length += this.buffer.write(s, this.length);
+};
+
+BufferWriter.prototype.toBuffer = function() {
+  return this.buffer.slice(0, this.length);
+};
+
+// Words are drawn from a vocabulary of `vocabulary` words (default 100,000)
+// with Zipf exponent `s` (default 1).
+function Corpus(options) {
+  options = options || {};
+  this.seed = options.seed || 1;
+  this.vocabulary = options.vocabulary || 100000;
+  this.s = options.s || 1;
+}
+
+Corpus.prototype.zipf = function(seed) {
+  if (!this.cachedZipf) this.cachedZipf = new Zipf(this.vocabulary, this.s, new Random(1));
+  var ret = Object.create(this.cachedZipf);
+  ret.random = new Random(this.seed * 7919 + seed);
+  return ret;
+};
+
+Corpus.prototype.phrase = function(zipf, random, maxWords) {
+  var n = 1 + Math.floor(random.next() * maxWords);
+  var words = [];
+  for (var i = 0; i < n; i++) words.push(word(zipf.next()));
+  return words.join(' ');
+};
+
+// nKeys newline-separated keys of 1 to maxWords (default 3) words. Common
+// words turn up in lots of keys, and some keys more than once.
+Corpus.prototype.dictionary = function(nKeys, maxWords) {
+  var zipf = this.zipf(1);
+  var random = new Random(this.seed * 31 + 1);
+  var out = new BufferWriter(nKeys * 16);
+  for (var i = 0; i < nKeys; i++) {
+    out.write(this.phrase(zipf, random, maxWords || 3));
+    out.write('\n');
+  }
+  return out.toBuffer();
+};
+
+// About `bytes` bytes of space-separated words
+Corpus.prototype.document = function(bytes, seed) {
+  var zipf = this.zipf(2 + (seed || 0));
+  var out = new BufferWriter(bytes + 64);
+  while (out.length < bytes) {
+    out.write(word(zipf.next()));
+    out.write(' ');
+  }
+  return out.toBuffer().slice(0, bytes);
+};
+
+// `n` keys: `hits` of them (a fraction) from the dictionary, the rest phrases
+// that almost certainly aren't in it.
+Corpus.prototype.lookups = function(dictionary, n, hits) {
+  var keys = dictionary.toString('utf-8').split('\n');
+  keys.pop();
+  var random = new Random(this.seed * 131 + 3);
+  var ret = [];
+  for (var i = 0; i < n; i++) {
+    if (random.next() < hits) {
+      ret.push(keys[Math.floor(random.next() * keys.length)]);
+    } else {
+      ret.push(word(this.vocabulary + Math.floor(random.next() * this.vocabulary)) + ' ' + word(i));
+    }
+  }
+  return ret;
+};
+
+module.exports = Corpus;
+module.exports.Random = Random;
+module.exports.Zipf = Zipf;
+module.exports.word = word;
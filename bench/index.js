@@ -0,0 +1,223 @@
+// Benchmarks. Usage:
+//
+//   node bench [--quick] [--full] [pattern ...]
+//
+// Runs every case whose name contains one of the patterns (all of them, by
+// default) and prints a table. --quick spends less time on each; --full adds
+// a 10M-key dictionary. Each case runs in its own process, so peak RSS is
+// that case's alone. Corpora are generated (see corpus.js), and identical on
+// every run, so numbers from two builds are comparable.
+var childProcess = require('child_process');
+var fs = require('fs');
+
+var Corpus = require('./corpus');
+
+var MB = 1024 * 1024;
+var DocumentBytes = MB;
+var NLookups = 100000;
+
+function dictionarySizes(full) {
+  return full ? [ 100000, 1000000, 10000000 ] : [ 100000, 1000000 ];
+}
+
+function label(nKeys) {
+  return nKeys >= 1000000 ? (nKeys / 1000000) + 'M' : (nKeys / 1000) + 'k';
+}
+
+// Each case: setup() returns whatever run() needs (not timed); run() does one
+// op and returns how many units (keys, bytes, lookups) it covered.
+function cases(full) {
+  var ret = [];
+
+  dictionarySizes(full).forEach(function(nKeys) {
+    [ {}, { threads: 0 }, { engine: 'automaton' }, { compact: true } ].forEach(function(options) {
+      var optionsLabel = Object.keys(options).map(function(k) { return k + ':' + options[k]; }).join(',');
+      if (options.engine && nKeys > 1000000) return; // takes minutes
+
+      ret.push({
+        name: 'build ' + label(nKeys) + (optionsLabel ? ' ' + optionsLabel : ''),
+        unit: 'keys',
+        setup: function(Set, corpus) { return corpus.dictionary(nKeys); },
+        run: function(Set, dictionary) {
+          new Set(dictionary, options);
+          return nKeys;
+        }
+      });
+    });
+
+    [ 'hit', 'miss' ].forEach(function(kind) {
+      [ 'String', 'Buffer' ].forEach(function(type) {
+        ret.push({
+          name: 'contains ' + kind + ' ' + label(nKeys) + ' ' + type,
+          unit: 'lookups',
+          setup: function(Set, corpus) {
+            var dictionary = corpus.dictionary(nKeys);
+            var keys = corpus.lookups(dictionary, NLookups, kind === 'hit' ? 1 : 0);
+            if (type === 'Buffer') keys = keys.map(function(k) { return Buffer.from(k, 'utf-8'); });
+            return { set: new Set(dictionary), keys: keys };
+          },
+          run: function(Set, state) {
+            var contains = state.set.contains;
+            var keys = state.keys;
+            for (var i = 0; i < keys.length; i++) contains(keys[i]);
+            return keys.length;
+          }
+        });
+      });
+    });
+
+    [ 'ngram', 'automaton' ].forEach(function(engine) {
+      if (engine === 'automaton' && nKeys > 1000000) return;
+
+      [ 1, 3, 5 ].forEach(function(n) {
+        ret.push({
+          name: 'findAllMatches n=' + n + ' ' + label(nKeys) + ' ' + engine,
+          unit: 'bytes',
+          setup: function(Set, corpus) {
+            return {
+              set: new Set(corpus.dictionary(nKeys), { engine: engine }),
+              doc: corpus.document(DocumentBytes)
+            };
+          },
+          run: function(Set, state) {
+            state.set.findAllMatches(state.doc, n);
+            return state.doc.length;
+          }
+        });
+      });
+    });
+
+    ret.push({
+      name: 'countMatches n=3 ' + label(nKeys),
+      unit: 'bytes',
+      setup: function(Set, corpus) {
+        return { set: new Set(corpus.dictionary(nKeys)), doc: corpus.document(DocumentBytes) };
+      },
+      run: function(Set, state) {
+        state.set.countMatches(state.doc, 3);
+        return state.doc.length;
+      }
+    });
+  });
+
+  ret.push({
+    name: 'findAllMatchesMany n=3 1M 1000x1KB',
+    unit: 'bytes',
+    setup: function(Set, corpus) {
+      var docs = [];
+      for (var i = 0; i < 1000; i++) docs.push(corpus.document(1024, i).toString('utf-8'));
+      return { set: new Set(corpus.dictionary(1000000)), docs: docs };
+    },
+    run: function(Set, state) {
+      state.set.findAllMatchesMany(state.docs, 3);
+      return state.docs.length * 1024;
+    }
+  });
+
+  return ret;
+}
+
+// Peak RSS, from the kernel where we can ask it (Linux), else as sampled.
+// resetPeak() makes it count from now on, if it can.
+var sampledPeak = 0;
+function peakRss() {
+  try {
+    var m = /VmHWM:\s*(\d+) kB/.exec(fs.readFileSync('/proc/self/status', 'utf-8'));
+    if (m) return +m[1] * 1024;
+  } catch (e) {}
+  sampledPeak = Math.max(sampledPeak, process.memoryUsage().rss);
+  return sampledPeak;
+}
+
+function resetPeak() {
+  try {
+    fs.writeFileSync('/proc/self/clear_refs', '5');
+  } catch (e) {}
+  sampledPeak = process.memoryUsage().rss;
+}
+
+// In the child: runs one case until it has taken minTime, and reports the
+// time per op.
+function runCase(c, minTime) {
+  var Set = require('../index');
+  var corpus = new Corpus();
+  var state = c.setup(Set, corpus);
+
+  resetPeak();
+  c.run(Set, state); // warm up
+
+  var nOps = 0;
+  var units = 0;
+  var start = process.hrtime();
+  var elapsed = 0;
+  while (nOps === 0 || elapsed < minTime) {
+    units += c.run(Set, state);
+    nOps++;
+    peakRss();
+    var t = process.hrtime(start);
+    elapsed = t[0] + t[1] / 1e9;
+  }
+
+  return { ops: nOps, seconds: elapsed, units: units, peakRss: peakRss() };
+}
+
+function format(result, unit) {
+  var perOp = result.seconds / result.ops;
+  var time = perOp >= 1 ? perOp.toFixed(2) + ' s' : perOp >= 1e-3 ? (perOp * 1e3).toFixed(2) + ' ms' : (perOp * 1e6).toFixed(2) + ' us';
+  var rate = result.units / result.seconds;
+  var throughput;
+  if (unit === 'bytes') {
+    throughput = (rate / MB).toFixed(1) + ' MB/s';
+  } else if (unit === 'lookups') {
+    throughput = (1e9 / rate).toFixed(0) + ' ns/lookup';
+  } else {
+    throughput = (rate / 1e6).toFixed(2) + 'M ' + unit + '/s';
+  }
+  return [ time, throughput, (result.peakRss / MB).toFixed(0) + ' MB' ];
+}
+
+function pad(s, n) {
+  while (s.length < n) s += ' ';
+  return s;
+}
+
+function main(argv) {
+  var quick = argv.indexOf('--quick') !== -1;
+  var full = argv.indexOf('--full') !== -1;
+  var caseIndex = argv.indexOf('--case');
+  var all = cases(full);
+
+  if (caseIndex !== -1) {
+    var name = argv[caseIndex + 1];
+    var c = all.filter(function(c) { return c.name === name; })[0];
+    process.send(runCase(c, quick ? 0.2 : 1));
+    return;
+  }
+
+  var patterns = argv.filter(function(a) { return a.slice(0, 2) !== '--'; });
+  var selected = all.filter(function(c) {
+    return patterns.length === 0 || patterns.some(function(p) { return c.name.indexOf(p) !== -1; });
+  });
+
+  console.log(pad('case', 40) + pad('time/op', 12) + pad('throughput', 18) + 'peak RSS');
+  var next = function(i) {
+    if (i === selected.length) return;
+    var c = selected[i];
+    var args = [ '--case', c.name ].concat(quick ? [ '--quick' ] : [], full ? [ '--full' ] : []);
+    var child = childProcess.fork(__filename, args, { execArgv: [ '--max-old-space-size=8192' ] });
+    var result = null;
+    child.on('message', function(m) { result = m; });
+    child.on('exit', function(code) {
+      if (result) {
+        var columns = format(result, c.unit);
+        console.log(pad(c.name, 40) + pad(columns[0], 12) + pad(columns[1], 18) + columns[2]);
+      } else {
+        console.log(pad(c.name, 40) + 'failed (exit code ' + code + ')');
+      }
+      next(i + 1);
+    });
+  };
+  next(0);
+}
+
+main(process.argv.slice(2));
@@ -2,7 +2,8 @@
   "targets": [
     {
       "target_name": "unordered_buffer_set",
-      "sources": [ "src/unordered_buffer_set.cc", "src/farmhash.cc" ],
+      "sources": [ "src/unordered_buffer_set.cc", "src/buffer_set.cc", "src/token_automaton.cc", "src/pool_memory.cc", "src/index_file.cc", "src/stream_matcher.cc", "src/crc32c_hash.cc", "src/farmhash.cc" ],
+      "defines": [ "NAPI_VERSION=3" ],
       "cflags": [ "-std=c++11", "-Wall" ],
       "xcode_settings": {
         "OTHER_CFLAGS": [ "-std=c++11", "-Wall" ],
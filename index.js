@@ -1 +1,27 @@
-module.exports = require('bindings')('unordered_buffer_set.node').UnorderedBufferSet;
+var Transform = require('stream').Transform;
+
+var UnorderedBufferSet = require('bindings')('unordered_buffer_set.node').UnorderedBufferSet;
+
+// A Transform stream: write a document to it, in as many chunks as you like,
+// and read `{ match, offset }` Objects, as from set.createMatcher().
+UnorderedBufferSet.prototype.createMatchStream = function(maxNgramSize) {
+  var matcher = this.createMatcher(maxNgramSize);
+
+  return new Transform({
+    readableObjectMode: true,
+
+    transform: function(chunk, encoding, callback) {
+      var matches = matcher.write(chunk);
+      for (var i = 0; i < matches.length; i++) this.push(matches[i]);
+      callback();
+    },
+
+    flush: function(callback) {
+      var matches = matcher.end();
+      for (var i = 0; i < matches.length; i++) this.push(matches[i]);
+      callback();
+    }
+  });
+};
+
+module.exports = UnorderedBufferSet;
@@ -0,0 +1,115 @@
+#ifndef BLOOM_FILTER_H_
+#define BLOOM_FILTER_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+// A blocked Bloom filter over 64-bit hashes.
+//
+// Most n-grams findAllMatches() looks up aren't keys. Each miss costs a probe
+// into the table, which for a big dictionary is a cache miss. This is a
+// fraction of the table's size (10 bits per key by default, versus 64 for a
+// slot), so it's far more likely to be in cache, and every lookup touches
+// exactly one 64-byte block: all of a key's bits are in the same block.
+//
+// A "no" is always right. A "yes" is wrong about 1% of the time at 10 bits
+// per key.
+class BloomFilter {
+public:
+  static const size_t BlockBits = 512;
+
+  BloomFilter(): blocks(NULL), blockMask(0), k(0) {}
+
+  ~BloomFilter() { free(this->blocks); }
+
+  // Makes room for n keys at bitsPerKey bits each, and forgets all keys.
+  void reset(size_t n, size_t bitsPerKey) {
+    size_t nBlocks = 1;
+    while (nBlocks * BlockBits < n * bitsPerKey) nBlocks <<= 1;
+
+    free(this->blocks);
+    void* p = NULL;
+    if (posix_memalign(&p, 64, nBlocks * sizeof(Block)) != 0) p = NULL;
+    this->blocks = static_cast<Block*>(p);
+    if (this->blocks) memset(this->blocks, 0, nBlocks * sizeof(Block));
+    this->blockMask = this->blocks ? nBlocks - 1 : 0;
+
+    // k = bitsPerKey * ln(2) is optimal; each bit takes 9 bits of hash
+    this->k = (bitsPerKey * 69 + 50) / 100;
+    if (this->k < 1) this->k = 1;
+    if (this->k > 7) this->k = 7;
+  }
+
+  bool empty() const { return this->blocks == NULL; }
+  size_t memoryUsage() const { return this->blocks ? (this->blockMask + 1) * sizeof(Block) : 0; }
+
+  void add(uint64_t hash) {
+    Block& block = this->blockFor(hash);
+    uint64_t bits = remix(hash);
+    for (int i = 0; i < this->k; i++, bits <<= 9) {
+      block.words[bits >> 61] |= bitFor(bits);
+    }
+  }
+
+  // Like add(), but safe to call from several threads at once.
+  void addConcurrently(uint64_t hash) {
+    Block& block = this->blockFor(hash);
+    uint64_t bits = remix(hash);
+    for (int i = 0; i < this->k; i++, bits <<= 9) {
+      __atomic_fetch_or(&block.words[bits >> 61], bitFor(bits), __ATOMIC_RELAXED);
+    }
+  }
+
+  bool mayContain(uint64_t hash) const {
+    const Block& block = this->blockFor(hash);
+    uint64_t bits = remix(hash);
+    for (int i = 0; i < this->k; i++, bits <<= 9) {
+      if ((block.words[bits >> 61] & bitFor(bits)) == 0) return false;
+    }
+    return true;
+  }
+
+  void prefetch(uint64_t hash) const {
+#if defined(__GNUC__)
+    __builtin_prefetch(&this->blockFor(hash));
+#endif
+  }
+
+private:
+  struct Block {
+    uint64_t words[BlockBits / 64];
+  };
+
+  Block* blocks;
+  size_t blockMask;
+  int k;
+
+  BloomFilter(const BloomFilter&);
+  BloomFilter& operator=(const BloomFilter&);
+
+  // The table picks buckets with the low bits and fingerprints with the top
+  // 16, so use the bits in between.
+  Block& blockFor(uint64_t hash) {
+    return this->blocks[(hash >> 16) & this->blockMask];
+  }
+
+  const Block& blockFor(uint64_t hash) const {
+    return this->blocks[(hash >> 16) & this->blockMask];
+  }
+
+  // Bit positions come 9 at a time from the top: the top bits of a product
+  // depend on every bit of the hash, so they're independent of the block.
+  static uint64_t remix(uint64_t hash) {
+    return (hash ^ (hash >> 29)) * 0x9e3779b97f4a7c15ULL;
+  }
+
+  // The top 9 bits of `bits` pick one of the block's 512 bits: 3 for the
+  // word, 6 for the bit.
+  static uint64_t bitFor(uint64_t bits) {
+    return static_cast<uint64_t>(1) << ((bits >> 55) & 63);
+  }
+};
+
+#endif  // BLOOM_FILTER_H_
@@ -0,0 +1,1067 @@
+#include "buffer_set.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "delimiter_scanner.h"
+#include "small_buffer.h"
+#include "token_automaton.h"
+
+static size_t
+count_char_in_str(char ch, const char* s, size_t len) {
+  Delimiters delimiters;
+  delimiters.add(ch);
+  return delimiters.count(s, len);
+}
+
+// Calls f(start, length, hash) for each line in s[0,end), including a last
+// line that doesn't end in '\n'. Lines are canonical keys: words separated by
+// `joiner`. One pass finds both newlines and joiners, so we hash each line
+// token by token as we go instead of re-reading it. With ids, lines are
+// "key\tid", and we skip from the tab to the next line.
+template<typename F> static void
+for_each_line(const char* s, const char* end, char joiner, token_hash::Family family, bool ids, F f) {
+  Delimiters delimiters;
+  delimiters.add('\n');
+  delimiters.add(joiner);
+  if (ids) delimiters.add('\t');
+
+  DelimiterScanner scanner(delimiters, s, end);
+  const char* lineStart = s;
+  const char* tokenStart = s;
+  uint64_t hash = 0;
+  bool inId = false;
+
+  for (const char* p = scanner.next(); ; p = scanner.next()) {
+    if (p == end && lineStart == end) break; // input ended with '\n'
+
+    if (inId) {
+      if (p == end) break;
+      if (*p == '\n') {
+        inId = false;
+        lineStart = tokenStart = p + 1;
+      }
+      continue;
+    }
+
+    const uint64_t tokenHash = token_hash::token(family, tokenStart, p - tokenStart);
+    hash = tokenStart == lineStart ? tokenHash : token_hash::extend(hash, tokenHash);
+
+    if (p == end || *p == '\n' || (ids && *p == '\t')) {
+      f(lineStart, p - lineStart, hash);
+      if (p == end) break;
+      if (*p == '\t') {
+        inId = true;
+        continue;
+      }
+      lineStart = p + 1;
+    }
+
+    tokenStart = p + 1;
+  }
+}
+
+// Reads a decimal uint32 that's all of s[0,len).
+static bool
+parse_id(const char* s, size_t len, uint32_t* id) {
+  if (len == 0 || len > 10) return false;
+  uint64_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] < '0' || s[i] > '9') return false;
+    n = n * 10 + (s[i] - '0');
+  }
+  if (n > 0xffffffff) return false;
+  *id = static_cast<uint32_t>(n);
+  return true;
+}
+
+// Splits a "key\tid" line, and returns the key's length. A line without a
+// valid id gets `row`.
+static size_t
+split_id(const char* s, size_t len, uint32_t row, uint32_t* id) {
+  const char* tab = static_cast<const char*>(memchr(s, '\t', len));
+  if (tab == NULL || !parse_id(tab + 1, s + len - tab - 1, id)) *id = row;
+  return tab ? tab - s : len;
+}
+
+// Writes id's digits to out (which has room for 10), and returns how many.
+static size_t
+format_id(uint32_t id, char* out) {
+  char digits[10];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + id % 10;
+    id /= 10;
+  } while (id);
+  for (size_t i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+  return n;
+}
+
+size_t
+count_keys(const char* s, size_t len, char separator) {
+  return count_char_in_str(separator, s, len) + (len > 0 && s[len - 1] != separator ? 1 : 0);
+}
+
+// How many threads to build from len bytes with, if asked for nThreads (0
+// means one per CPU): no more than there are CPUs, and none with less than
+// MinBytesPerThread to do.
+static size_t
+threads_for_build(size_t len, size_t nThreads) {
+  static const size_t MinBytesPerThread = 1 << 16;
+
+  const size_t nCpus = std::max<size_t>(1, std::thread::hardware_concurrency());
+  if (nThreads == 0 || nThreads > nCpus) nThreads = nCpus;
+  return std::max<size_t>(1, std::min(nThreads, len / MinBytesPerThread + 1));
+}
+
+BufferSet::BufferSet(PreparedInput& input, const Options& options)
+  : builtWith(options), set(PooledStringTraits(options.tokenizer.joinerByte(), options.tokenizer.hashFamily(), options.ids)), tokenizer(options.tokenizer),
+    bitsPerKey(options.bloom == Options::NoBloom ? 0 : options.bitsPerKey)
+{
+  this->memory.adopt(input.memory);
+
+  if (input.index) {
+    this->mem = input.index->pool;
+    this->memLength = input.index->poolLength;
+    this->set.setBase(this->mem, this->memLength);
+    this->set.borrowSlots(static_cast<const PooledStringTable::Slot*>(input.index->slots), input.index->capacity, input.index->count,
+        input.index->pilots, input.index->buckets, input.index->seed);
+  } else {
+    if (!this->tokenizer.isPlain() || options.ids) this->canonicalizeText();
+
+    this->mem = this->memory.data();
+    this->memLength = this->memory.size();
+
+    const size_t nThreads = threads_for_build(this->memLength, options.threads);
+    if (options.bloom == Options::FilterOnly) {
+      this->buildFilterFromText();
+    } else if (nThreads > 1) {
+      this->buildFromTextInParallel(nThreads);
+    } else {
+      this->buildFromText();
+    }
+
+    if (options.compact && options.bloom != Options::FilterOnly) this->compactPool(options.shareSuffixes);
+  }
+
+  // If it can't be done, we keep the table we have
+  if (options.perfectHash && options.bloom != Options::FilterOnly && !this->set.isPerfect()) this->set.makePerfect();
+
+  // An index file: hash its keys again
+  if (this->bitsPerKey && this->bloom.empty()) this->rebuildBloom();
+
+  if (options.bloom == Options::FilterOnly) {
+    this->filterOnly = true;
+    this->set.clear();
+    this->memory.release();
+    this->mem = NULL;
+    this->memLength = 0;
+  }
+
+  this->wantsAutomaton = options.automaton;
+  if (this->wantsAutomaton) this->buildAutomaton();
+}
+
+void
+BufferSet::buildAutomaton()
+{
+  this->automaton = new TokenAutomaton(this->mem, this->memLength, this->tokenizer, this->hasIds());
+  this->set.forEach([this](const PooledStringTable::Slot& slot) {
+    this->automaton->add(this->set.keyData(slot), this->set.keyLength(slot), this->hasIds() ? this->idOf(slot) : 0);
+  });
+  this->automaton->compile();
+}
+
+// Sizes the Bloom filter for the keys we have now, and adds them.
+void
+BufferSet::rebuildBloom()
+{
+  this->bloom.reset(this->set.size(), this->bitsPerKey);
+  this->set.forEach([this](const PooledStringTable::Slot& slot) {
+    this->bloom.add(this->set.hashOf(slot));
+  });
+}
+
+// Replaces memory with the canonical form of each of its lines. That's never
+// longer than the original (plus a final '\n'), because words only get
+// shorter and several delimiters become at most one joiner.
+//
+// With ids, each line becomes "key\tid\n", with the id in plain decimal, so
+// everything else can find a key's id right after its tab. A line that had
+// no id gets up to 11 bytes longer.
+void
+BufferSet::canonicalizeText()
+{
+  const bool ids = this->hasIds();
+  const char* s = this->memory.data();
+  const char* end = s + this->memory.size();
+  const size_t maxLength = this->memory.size() + 1 + (ids ? count_keys(s, end - s, '\n') * 11 : 0);
+  char* canonical = new char[maxLength];
+  size_t length = 0;
+  uint32_t row = 0;
+
+  while (s < end) {
+    const char* p = static_cast<const char*>(memchr(s, '\n', end - s));
+    if (p == NULL) p = end;
+
+    size_t keyLength = p - s;
+    uint32_t id = 0;
+    if (ids) keyLength = split_id(s, keyLength, row++, &id);
+
+    if (this->tokenizer.isPlain()) {
+      memcpy(canonical + length, s, keyLength);
+      length += keyLength;
+    } else {
+      length += this->tokenizer.canonicalize(s, keyLength, canonical + length);
+    }
+    if (ids) {
+      canonical[length++] = '\t';
+      length += format_id(id, canonical + length);
+    }
+    canonical[length++] = '\n';
+
+    s = p + 1;
+  }
+
+  this->memory.take(canonical, length);
+}
+
+// Replaces memory with just the keys in the table (pool and arena), each
+// followed by '\n', and points the table at them. Duplicate lines, deleted
+// keys, and the newlines between them, go away.
+//
+// With shareSuffixes, a key that's a suffix of another key ("of oxford" in
+// "university of oxford") isn't copied at all: since keys end at their
+// terminator, it can point into the longer one. Sorting keys by their
+// reversed bytes puts every such key right before a key it ends. With ids,
+// every key is followed by its own id, so nothing is shared.
+void
+BufferSet::compactPool(bool shareSuffixes)
+{
+  const PooledStringTable::Slot* slots = this->set.rawSlots();
+  std::vector<uint64_t> newOffsets(this->set.capacity());
+  char* pool;
+  size_t length = 0;
+
+  if (!shareSuffixes || this->hasIds()) {
+    this->set.forEach([&](const PooledStringTable::Slot& slot) {
+      length += this->recordLength(slot) + 1;
+    });
+    pool = new char[length + 1];
+    length = 0;
+    this->set.forEach([&](const PooledStringTable::Slot& slot) {
+      const size_t recordLength = this->recordLength(slot);
+      memcpy(pool + length, this->set.keyData(slot), recordLength);
+      pool[length + recordLength] = '\n';
+      newOffsets[&slot - slots] = length;
+      length += recordLength + 1;
+    });
+  } else {
+    std::vector<size_t> order; // slot indices
+    std::vector<PooledString> keys(this->set.capacity());
+    order.reserve(this->set.size());
+    this->set.forEach([&](const PooledStringTable::Slot& slot) {
+      order.push_back(&slot - slots);
+      keys[&slot - slots] = PooledString(this->set.keyData(slot), this->set.keyLength(slot));
+    });
+
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+      const PooledString& ka = keys[a];
+      const PooledString& kb = keys[b];
+      const size_t n = std::min(ka.length, kb.length);
+      for (size_t i = 1; i <= n; i++) {
+        const unsigned char ca = ka.start[ka.length - i];
+        const unsigned char cb = kb.start[kb.length - i];
+        if (ca != cb) return ca < cb;
+      }
+      return ka.length < kb.length;
+    });
+
+    // Does order[i]'s key end order[i + 1]'s?
+    auto endsNext = [&](size_t i) {
+      if (i + 1 == order.size()) return false;
+      const PooledString& k = keys[order[i]];
+      const PooledString& next = keys[order[i + 1]];
+      return memcmp(k.start, next.start + next.length - k.length, k.length) == 0;
+    };
+
+    for (size_t i = 0; i < order.size(); i++) {
+      if (!endsNext(i)) length += keys[order[i]].length + 1;
+    }
+    pool = new char[length + 1];
+    length = 0;
+
+    // Longest first, so the key we point into already has its offset
+    for (size_t i = order.size(); i > 0; i--) {
+      const PooledString& k = keys[order[i - 1]];
+      if (endsNext(i - 1)) {
+        const PooledString& next = keys[order[i]];
+        newOffsets[order[i - 1]] = newOffsets[order[i]] + next.length - k.length;
+      } else {
+        memcpy(pool + length, k.start, k.length);
+        pool[length + k.length] = '\n';
+        newOffsets[order[i - 1]] = length;
+        length += k.length + 1;
+      }
+    }
+  }
+
+  this->set.rebase(pool, length, [&](const PooledStringTable::Slot& slot) {
+    return newOffsets[&slot - slots];
+  });
+  this->memory.take(pool, length);
+  this->mem = this->memory.data();
+  this->memLength = this->memory.size();
+  std::vector<char>().swap(this->arena);
+}
+
+void
+BufferSet::buildFromText()
+{
+  const size_t nLines = count_char_in_str('\n', this->mem, this->memLength) + 1;
+  this->set.setBase(this->mem, this->memLength);
+  this->set.reserve(nLines);
+  if (this->bitsPerKey) this->bloom.reset(nLines, this->bitsPerKey);
+
+  for_each_line(this->mem, this->mem + this->memLength, this->tokenizer.joinerByte(), this->tokenizer.hashFamily(), this->hasIds(), [this](const char* s, size_t len, uint64_t hash) {
+    this->insert(s, len, hash);
+  });
+}
+
+BufferSet::~BufferSet()
+{
+  delete this->automaton;
+}
+
+// Calls f(0), f(1), ..., f(nThreads - 1), each on its own thread (f(0) on
+// this one), and waits for them all.
+template<typename F> static void
+run_in_parallel(size_t nThreads, F f) {
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nThreads; t++) threads.push_back(std::thread(f, t));
+  f(0);
+  for (auto i = threads.begin(); i < threads.end(); i++) i->join();
+}
+
+// Does what buildFromText() does, on several threads:
+//
+// 1. Split mem into one line-aligned chunk per thread. Each thread counts its
+//    lines, so we can size the table.
+// 2. Each thread hashes its lines and sorts them by which region of the table
+//    they belong in.
+// 3. Threads fill disjoint regions of the table, in parallel.
+// 4. We insert the few keys that spilled across region boundaries.
+void
+BufferSet::buildFromTextInParallel(size_t nThreads)
+{
+  typedef PooledStringTable::Entry Entry;
+
+  const char* const end = this->mem + this->memLength;
+
+  std::vector<const char*> chunkStarts(nThreads + 1);
+  chunkStarts[0] = this->mem;
+  chunkStarts[nThreads] = end;
+  for (size_t t = 1; t < nThreads; t++) {
+    const char* p = std::max(chunkStarts[t - 1], this->mem + this->memLength / nThreads * t);
+    const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    chunkStarts[t] = newline ? newline + 1 : end;
+  }
+
+  // 1. Count
+  std::vector<size_t> lineCounts(nThreads);
+  run_in_parallel(nThreads, [&](size_t t) {
+    const char* chunkEnd = chunkStarts[t + 1];
+    lineCounts[t] = count_char_in_str('\n', chunkStarts[t], chunkEnd - chunkStarts[t]);
+    if (chunkEnd == end && chunkStarts[t] < chunkEnd && chunkEnd[-1] != '\n') lineCounts[t]++;
+  });
+
+  size_t nLines = 0;
+  for (auto i = lineCounts.begin(); i < lineCounts.end(); i++) nLines += *i;
+
+  this->set.setBase(this->mem, this->memLength);
+  this->set.reserve(nLines);
+  if (this->bitsPerKey) this->bloom.reset(nLines, this->bitsPerKey);
+
+  // Regions are a power of two, so an entry's region is the top bits of its
+  // home bucket. Use a few per thread, so one crowded region doesn't hold
+  // everybody up.
+  const size_t capacity = this->set.capacity();
+  size_t nRegions = 1;
+  int regionShift = 0;
+  while (nRegions < nThreads * 4 && nRegions < capacity) nRegions <<= 1;
+  while ((static_cast<size_t>(1) << regionShift) < capacity / nRegions) regionShift++;
+  const size_t regionSize = capacity / nRegions;
+
+  // 2. Hash. entries[t * nRegions + r] holds chunk t's keys for region r.
+  std::vector<std::vector<Entry> > entries(nThreads * nRegions);
+  run_in_parallel(nThreads, [&](size_t t) {
+    std::vector<Entry>* regions = &entries[t * nRegions];
+
+    for_each_line(chunkStarts[t], chunkStarts[t + 1], this->tokenizer.joinerByte(), this->tokenizer.hashFamily(), this->hasIds(), [&](const char* s, size_t len, uint64_t hash) {
+      Entry entry = { static_cast<uint64_t>(s - this->mem), hash, static_cast<uint32_t>(len) };
+      regions[(hash & (capacity - 1)) >> regionShift].push_back(entry);
+      if (this->bitsPerKey) this->bloom.addConcurrently(hash);
+    });
+  });
+
+  // 3. Insert
+  std::vector<std::vector<Entry> > overflow(nRegions);
+  std::vector<size_t> inserted(nThreads, 0);
+  std::atomic<size_t> nextRegion(0);
+  run_in_parallel(nThreads, [&](size_t t) {
+    size_t r;
+    while ((r = nextRegion++) < nRegions) {
+      // In chunk order, so the first copy of a duplicate wins, as usual
+      for (size_t chunk = 0; chunk < nThreads; chunk++) {
+        const std::vector<Entry>& e = entries[chunk * nRegions + r];
+        inserted[t] += this->set.insertInRange(e.data(), e.size(), r * regionSize, (r + 1) * regionSize, &overflow[r]);
+      }
+    }
+  });
+
+  // 4. Clean up
+  for (auto i = inserted.begin(); i < inserted.end(); i++) this->set.addCount(*i);
+  for (auto i = overflow.begin(); i < overflow.end(); i++) {
+    for (auto e = i->begin(); e < i->end(); e++) {
+      this->set.insert(e->offset, e->length, e->hash);
+    }
+  }
+}
+
+// Adds every line to the Bloom filter, and builds no table.
+void
+BufferSet::buildFilterFromText()
+{
+  this->bloom.reset(count_char_in_str('\n', this->mem, this->memLength) + 1, this->bitsPerKey);
+  for_each_line(this->mem, this->mem + this->memLength, this->tokenizer.joinerByte(), this->tokenizer.hashFamily(), this->hasIds(), [this](const char* s, size_t len, uint64_t hash) {
+    this->bloom.add(hash);
+  });
+}
+
+void
+BufferSet::insert(const char* s, size_t len, uint64_t hash)
+{
+  this->set.insert(s - this->mem, len, hash);
+  if (this->bitsPerKey) this->bloom.add(hash);
+}
+
+uint64_t
+BufferSet::hashKey(const char* s, size_t len) const
+{
+  return this->tokenizer.isPlain()
+    ? token_hash::hash(this->tokenizer.hashFamily(), s, len)
+    : this->tokenizer.hash(s, len);
+}
+
+const PooledStringTable::Slot*
+BufferSet::findKey(const char* s, size_t len, uint64_t hash, uint64_t* probes) const
+{
+  if (this->tokenizer.isPlain()) return this->set.find(s, len, hash, probes);
+
+  const Tokenizer& tokenizer = this->tokenizer;
+  return this->set.find(hash, [&tokenizer, s, len](const char* key, size_t keyLength) {
+    return tokenizer.equalsCanonical(s, len, key, keyLength);
+  }, probes);
+}
+
+bool
+BufferSet::contains(const char* s, size_t len) const
+{
+  SearchCounters counters;
+  counters.searches = 1;
+  counters.bytesHashed = len;
+  const bool ret = this->hasKey(s, len, this->hashKey(s, len), counters);
+  this->record(counters);
+  return ret;
+}
+
+bool
+BufferSet::hasKey(const char* s, size_t len, uint64_t hash, SearchCounters& counters) const
+{
+  counters.lookups++;
+  if (!this->passesFilter(hash)) {
+    counters.filtered++;
+    return false;
+  }
+  if (!this->filterOnly && this->findKey(s, len, hash, &counters.probes) == NULL) return false;
+  counters.hits++;
+  return true;
+}
+
+void
+BufferSet::record(const SearchCounters& counters) const
+{
+  if (!this->builtWith.counters) return;
+  std::lock_guard<std::mutex> lock(this->countersMutex);
+  this->totals.add(counters);
+}
+
+SearchCounters
+BufferSet::counters() const
+{
+  std::lock_guard<std::mutex> lock(this->countersMutex);
+  return this->totals;
+}
+
+BufferSet::Stats
+BufferSet::stats() const
+{
+  Stats ret;
+  ret.keys = this->set.size();
+  ret.capacity = this->set.capacity();
+  ret.perfectHash = this->set.isPerfect();
+  this->set.forEach([&ret](const PooledStringTable::Slot& slot) {
+    const size_t length = PooledStringTable::probeLength(slot);
+    if (ret.probeLengths.size() < length) ret.probeLengths.resize(length);
+    ret.probeLengths[length - 1]++;
+  });
+  ret.poolBytes = this->memLength;
+  ret.arenaBytes = this->arena.size();
+  ret.tableBytes = this->set.memoryUsage();
+  ret.bloomBytes = this->bloom.memoryUsage();
+  ret.automatonBytes = this->automaton ? this->automaton->memoryUsage() : 0;
+  return ret;
+}
+
+void
+BufferSet::prefetch(uint64_t hash) const
+{
+  if (this->bloom.empty()) {
+    this->set.prefetch(hash);
+  } else {
+    this->bloom.prefetch(hash);
+  }
+}
+
+void
+BufferSet::prepareToModify()
+{
+  this->set.ownSlots(); // an index file's are read-only
+  // It points into the pool, and it can't add keys: use the n-gram window
+  // until the next compact().
+  delete this->automaton;
+  this->automaton = NULL;
+}
+
+uint32_t
+BufferSet::idOf(const PooledStringTable::Slot& slot) const
+{
+  const char* p = this->set.keyData(slot) + this->set.keyLength(slot) + 1;
+  uint32_t id = 0;
+  for (; *p >= '0' && *p <= '9'; p++) id = id * 10 + (*p - '0');
+  return id;
+}
+
+size_t
+BufferSet::recordLength(const PooledStringTable::Slot& slot) const
+{
+  const char* key = this->set.keyData(slot);
+  size_t length = this->set.keyLength(slot);
+  if (this->hasIds()) {
+    length++;
+    while (key[length] >= '0' && key[length] <= '9') length++;
+  }
+  return length;
+}
+
+bool
+BufferSet::add(const char* s, size_t len, uint32_t id)
+{
+  this->prepareToModify();
+  const uint64_t hash = this->hashKey(s, len);
+
+  if (this->filterOnly) {
+    const bool ret = !this->bloom.mayContain(hash);
+    this->bloom.add(hash);
+    return ret;
+  }
+
+  if (this->findKey(s, len, hash) != NULL) return false;
+
+  if (this->arena.empty()) {
+    this->arenaStart = this->memLength;
+    this->arena.push_back('\n');
+  }
+
+  // Appending to a vector is amortized O(1): it doubles when it's full.
+  const size_t offset = this->arena.size();
+  this->arena.resize(offset + len + 1 + (this->hasIds() ? 11 : 0));
+  char* key = &this->arena[offset];
+  size_t keyLength = len;
+  if (this->tokenizer.isPlain()) {
+    memcpy(key, s, len);
+  } else {
+    keyLength = this->tokenizer.canonicalize(s, len, key);
+  }
+  if (this->hasIds()) {
+    key[keyLength++] = '\t';
+    keyLength += format_id(id, key + keyLength);
+  }
+  key[keyLength] = '\n';
+  this->arena.resize(offset + keyLength + 1);
+
+  this->set.setArena(this->arena.data(), this->arena.size(), this->arenaStart);
+  this->set.insertNew(this->arenaStart + offset, hash);
+  if (this->bitsPerKey) this->bloom.add(hash);
+  return true;
+}
+
+// Splits s like containsMany() does, and add()s each key. Returns the number
+// of keys that were new.
+size_t
+BufferSet::addMany(const char* s, size_t len, char separator)
+{
+  this->prepareToModify();
+  if (!this->filterOnly) {
+    this->set.reserve(this->set.size() + count_keys(s, len, separator));
+    this->arena.reserve(this->arena.size() + len + 2);
+    // It may have moved
+    if (!this->arena.empty()) this->set.setArena(this->arena.data(), this->arena.size(), this->arenaStart);
+  }
+
+  size_t ret = 0;
+  uint32_t row = 0;
+  const char* end = s + len;
+  while (s < end) {
+    const char* p = static_cast<const char*>(memchr(s, separator, end - s));
+    if (p == NULL) p = end;
+    size_t keyLength = p - s;
+    uint32_t id = 0;
+    if (this->hasIds()) keyLength = split_id(s, keyLength, row++, &id);
+    if (this->add(s, keyLength, id)) ret++;
+    s = p + 1;
+  }
+  return ret;
+}
+
+// The key's bytes stay where they are (in the pool or the arena) until the
+// next compact(). A Bloom filter can't forget keys, so it'll let the deleted
+// key through to the table; compact() rebuilds it.
+bool
+BufferSet::remove(const char* s, size_t len)
+{
+  this->prepareToModify();
+  const PooledStringTable::Slot* slot = this->findKey(s, len, this->hashKey(s, len));
+  if (slot == NULL) return false;
+  this->set.erase(slot);
+  return true;
+}
+
+void
+BufferSet::compact(bool shareSuffixes)
+{
+  if (this->filterOnly) return; // there's nothing to compact
+
+  this->prepareToModify();
+  this->compactPool(shareSuffixes);
+  if (this->builtWith.perfectHash) this->set.makePerfect();
+  if (this->bitsPerKey) this->rebuildBloom();
+  if (this->wantsAutomaton) this->buildAutomaton();
+}
+
+bool
+BufferSet::serialize(const char* path, const char** syscall) const
+{
+  return index_file::write(path, pooled_string_hash_id(this->tokenizer.hashFamily()), this->tokenizer.fingerprint(), this->hasIds(),
+      this->mem, this->memLength, this->arena.data(), this->arena.size(),
+      this->set.rawSlots(), sizeof(PooledStringTable::Slot), this->set.capacity(), this->set.size(),
+      this->set.rawPilots(), this->set.bucketCount(), this->set.perfectSeed(), syscall);
+}
+
+void
+BufferSet::containsMany(const char* s, size_t len, char separator, uint8_t* ret) const
+{
+  SearchCounters counters;
+  counters.searches = 1;
+  counters.bytesHashed = len;
+
+  // Hash and prefetch a group of keys, then look them all up: the table
+  // lookups' cache misses overlap instead of happening one after another.
+  static const size_t GroupSize = 16;
+  PooledString keys[GroupSize];
+  uint64_t hashes[GroupSize];
+
+  const char* end = s + len;
+  while (s < end) {
+    size_t n = 0;
+    for (; n < GroupSize && s < end; n++) {
+      const char* p = static_cast<const char*>(memchr(s, separator, end - s));
+      if (p == NULL) p = end;
+
+      keys[n].start = s;
+      keys[n].length = p - s;
+      hashes[n] = this->hashKey(s, p - s);
+      this->prefetch(hashes[n]);
+
+      s = p + 1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      *ret++ = this->hasKey(keys[i].start, keys[i].length, hashes[i], counters) ? 1 : 0;
+    }
+  }
+
+  this->record(counters);
+}
+
+// An n-gram that ends at the current word: where it starts, the hash of all
+// its words so far, and the index of its first word.
+struct NgramStart {
+  const char* start;
+  uint64_t hash;
+  size_t firstWord;
+
+  NgramStart(): start(NULL), hash(0), firstWord(0) {}
+  NgramStart(const char* start, uint64_t hash, size_t firstWord): start(start), hash(hash), firstWord(firstWord) {}
+};
+
+// Most searches are for a handful of words at most; those keep their
+// scratch space on the stack.
+static const size_t InlineNgramSize = 16;
+
+bool
+BufferSet::getId(const char* s, size_t len, uint32_t* id) const
+{
+  SearchCounters counters;
+  counters.searches = 1;
+  counters.lookups = 1;
+  counters.bytesHashed = len;
+
+  const uint64_t hash = this->hashKey(s, len);
+  const PooledStringTable::Slot* slot = NULL;
+  if (this->passesFilter(hash)) {
+    slot = this->findKey(s, len, hash, &counters.probes);
+  } else {
+    counters.filtered++;
+  }
+  if (slot) {
+    counters.hits++;
+    *id = this->idOf(*slot);
+  }
+  this->record(counters);
+  return slot != NULL;
+}
+
+std::vector<PooledString>
+BufferSet::findAllMatches(const char* s, size_t len, size_t maxNgramSize, size_t nThreads) const {
+  std::vector<PooledString> ret;
+  this->findMatches(s, len, maxNgramSize, &ret, NULL, nThreads);
+  return ret;
+}
+
+std::vector<uint32_t>
+BufferSet::findAllMatchIds(const char* s, size_t len, size_t maxNgramSize, size_t nThreads) const {
+  std::vector<uint32_t> ret;
+  this->findMatches(s, len, maxNgramSize, NULL, &ret, nThreads);
+  return ret;
+}
+
+uint32_t
+BufferSet::idOfKey(uint64_t key) const
+{
+  if (this->automaton) return this->automaton->keyId(static_cast<uint32_t>(key));
+  return this->idOf(this->set.rawSlots()[key]);
+}
+
+// Calls f(start, length, key) for each match, in order, and counts into
+// `counters`. `key` identifies the key it matched: the automaton's state,
+// the slot's index in the table or, filterOnly, the hash.
+template<typename F> void
+BufferSet::forEachMatch(const char* s, size_t len, size_t maxNgramSize, F f, SearchCounters& counters) const {
+  if (this->automaton) {
+    this->automaton->forEachMatch(s, len, maxNgramSize, [&f](const char* start, size_t length, uint32_t state) {
+      f(start, length, static_cast<uint64_t>(state));
+    }, &counters);
+    return;
+  }
+
+  // The usual sizes get their own copy of the loop, with maxNgramSize a
+  // constant: the ring's arithmetic folds away and the probe loops unroll.
+  // With 1, there's no window at all.
+  switch (maxNgramSize) {
+    case 1: this->forEachNgramMatch<1>(s, len, maxNgramSize, f, counters); break;
+    case 2: this->forEachNgramMatch<2>(s, len, maxNgramSize, f, counters); break;
+    case 3: this->forEachNgramMatch<3>(s, len, maxNgramSize, f, counters); break;
+    case 4: this->forEachNgramMatch<4>(s, len, maxNgramSize, f, counters); break;
+    case 5: this->forEachNgramMatch<5>(s, len, maxNgramSize, f, counters); break;
+    case 6: this->forEachNgramMatch<6>(s, len, maxNgramSize, f, counters); break;
+    case 7: this->forEachNgramMatch<7>(s, len, maxNgramSize, f, counters); break;
+    case 8: this->forEachNgramMatch<8>(s, len, maxNgramSize, f, counters); break;
+    default: this->forEachNgramMatch<0>(s, len, maxNgramSize, f, counters); break;
+  }
+}
+
+// forEachMatch() without the automaton. N is maxNgramSize, or 0 if it's
+// only known at run time.
+template<size_t N, typename F> void
+BufferSet::forEachNgramMatch(const char* s, size_t len, size_t runtimeNgramSize, F f, SearchCounters& counters) const {
+  const size_t maxNgramSize = N ? N : runtimeNgramSize;
+
+  // With a plain Tokenizer, an n-gram's bytes are its canonical form, so we
+  // can compare bytes. Otherwise we compare words, so we need to remember
+  // the last maxNgramSize of them.
+  const bool plain = this->tokenizer.isPlain();
+  const char joiner = this->tokenizer.joinerByte();
+  SmallBuffer<PooledString, N ? N : InlineNgramSize> words(plain ? 0 : maxNgramSize);
+
+  // The n-grams that end at the current word, in a ring: they start at the
+  // last maxNgramSize words, so word w's goes in ngrams[w % maxNgramSize].
+  SmallBuffer<NgramStart, N ? N : InlineNgramSize> ngrams(maxNgramSize);
+  auto next = [maxNgramSize](size_t r) { return r + 1 == maxNgramSize ? 0 : r + 1; };
+  Tokenizer::Iterator it(this->tokenizer, s, s + len);
+  const char* word;
+  size_t wordLength;
+  size_t nWords = 0;
+
+  while (it.next(&word, &wordLength)) {
+    if (!plain) {
+      words[nWords % maxNgramSize].start = word;
+      words[nWords % maxNgramSize].length = wordLength;
+    }
+
+    // Hash the word once, then extend every n-gram that ends here by it.
+    // Prefetch all their slots before looking any of them up.
+    const uint64_t wordHash = this->tokenizer.wordHash(word, wordLength);
+    counters.bytesHashed += wordLength;
+    const size_t nOlder = std::min(nWords, maxNgramSize - 1);
+    const size_t oldest = (nWords - nOlder) % maxNgramSize;
+    for (size_t k = 0, r = oldest; k < nOlder; k++, r = next(r)) {
+      ngrams[r].hash = token_hash::extend(ngrams[r].hash, wordHash);
+      this->prefetch(ngrams[r].hash);
+    }
+    ngrams[nWords % maxNgramSize] = NgramStart(word, wordHash, nWords);
+    this->prefetch(wordHash);
+    nWords++;
+
+    // Add s[oldest start,wordEnd), ..., s[word,wordEnd) for every n-gram in
+    // the set
+    const char* wordEnd = word + wordLength;
+    for (size_t k = 0, r = oldest; k <= nOlder; k++, r = next(r)) {
+      const NgramStart* i = &ngrams[r];
+      const size_t ngramLength = wordEnd - i->start;
+      const PooledStringTable::Slot* slot = NULL;
+      bool found;
+      counters.lookups++;
+
+      if (!this->passesFilter(i->hash)) {
+        counters.filtered++;
+        found = false;
+      } else if (this->filterOnly) {
+        counters.hits++;
+        f(i->start, ngramLength, i->hash);
+        continue;
+      } else if (plain) {
+        slot = this->set.find(i->start, ngramLength, i->hash, &counters.probes);
+        found = slot != NULL;
+      } else {
+        const size_t firstWord = i->firstWord;
+        const Tokenizer& tokenizer = this->tokenizer;
+        slot = this->set.find(i->hash, [&words, &tokenizer, firstWord, nWords, maxNgramSize, joiner](const char* key, size_t keyLength) {
+          const char* keyEnd = key + keyLength;
+          for (size_t w = firstWord; w < nWords; w++) {
+            const PooledString& ngramWord = words[w % maxNgramSize];
+            if (w != firstWord) {
+              if (key == keyEnd || *key != joiner) return false;
+              key++;
+            }
+            if (static_cast<size_t>(keyEnd - key) < ngramWord.length
+                || !tokenizer.wordEquals(ngramWord.start, ngramWord.length, key)) {
+              return false;
+            }
+            key += ngramWord.length;
+          }
+          return key == keyEnd;
+        }, &counters.probes);
+        found = slot != NULL;
+      }
+
+      if (found) {
+        counters.hits++;
+        f(i->start, ngramLength, static_cast<uint64_t>(slot - this->set.rawSlots()));
+      }
+    }
+  }
+}
+
+// Below this many bytes per thread, starting a thread costs more than it saves
+static size_t
+threads_for_search(size_t len, size_t nThreads) {
+  static const size_t MinBytesPerThread = 1 << 16;
+
+  if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+  return std::max<size_t>(1, std::min(nThreads, len / MinBytesPerThread + 1));
+}
+
+// Splits s at a delimiter per thread. Each thread finds the matches that end
+// in its piece: it starts maxNgramSize - 1 words early, for n-grams that
+// start in the piece before, and skips matches that end there. Matches are
+// in order of where they end, so the pieces' results just go back to back.
+//
+// Calls f(t, start, length, from) on piece t's thread: search
+// s[start,start+length) and skip matches that end at or before from (NULL
+// for the first piece).
+template<typename F> void
+BufferSet::forEachPiece(const char* s, size_t len, size_t maxNgramSize, size_t nThreads, F f) const {
+  if (nThreads <= 1) {
+    f(0, s, len, static_cast<const char*>(NULL));
+    return;
+  }
+
+  // Piece t's words end in (cuts[t], cuts[t + 1]]. Inner cuts are delimiters
+  // (or end, when the pieces run out early).
+  const Delimiters& delimiters = this->tokenizer.delimiterSet();
+  const char* const end = s + len;
+  std::vector<const char*> cuts(nThreads + 1);
+  cuts[0] = NULL;
+  cuts[nThreads] = end;
+  for (size_t t = 1; t < nThreads; t++) {
+    const char* p = s + len / nThreads * t;
+    if (t > 1) p = std::max(p, std::min(cuts[t - 1] + 1, end));
+    while (p < end && !delimiters.contains(*p)) p++;
+    cuts[t] = p;
+  }
+
+  run_in_parallel(nThreads, [&](size_t t) {
+    const char* from = cuts[t];
+    if (from == end) return; // an earlier piece got everything
+
+    const char* start = s;
+    if (from != NULL) {
+      start = maxNgramSize > 1 ? this->tokenizer.lastWordsStart(s, from, maxNgramSize - 1) : from + 1;
+    }
+    f(t, start, static_cast<size_t>(cuts[t + 1] - start), from);
+  });
+}
+
+void
+BufferSet::findMatches(const char* s, size_t len, size_t maxNgramSize,
+    std::vector<PooledString>* matches, std::vector<uint32_t>* ids, size_t nThreads) const {
+  nThreads = threads_for_search(len, nThreads);
+
+  std::vector<std::vector<PooledString> > pieceMatches(nThreads);
+  std::vector<std::vector<uint32_t> > pieceIds(nThreads);
+  this->forEachPiece(s, len, maxNgramSize, nThreads, [&](size_t t, const char* start, size_t length, const char* from) {
+    // One piece goes straight into the results
+    std::vector<PooledString>* found = nThreads == 1 ? matches : matches ? &pieceMatches[t] : NULL;
+    std::vector<uint32_t>* foundIds = nThreads == 1 ? ids : ids ? &pieceIds[t] : NULL;
+
+    SearchCounters counters;
+    counters.searches = t == 0 ? 1 : 0;
+    this->forEachMatch(start, length, maxNgramSize, [&](const char* m, size_t l, uint64_t key) {
+      if (from != NULL && m + l <= from) return;
+      if (found) found->push_back(PooledString(m, l));
+      if (foundIds) foundIds->push_back(this->idOfKey(key)); // never filterOnly
+    }, counters);
+    this->record(counters);
+  });
+  if (nThreads == 1) return;
+
+  for (size_t t = 0; t < nThreads; t++) {
+    if (matches) matches->insert(matches->end(), pieceMatches[t].begin(), pieceMatches[t].end());
+    if (ids) ids->insert(ids->end(), pieceIds[t].begin(), pieceIds[t].end());
+  }
+}
+
+// Counts matches by key. A small open-addressing table maps each key to its
+// index in `counts`, which is in order of first match.
+class MatchCounter {
+public:
+  std::vector<BufferSet::MatchCount> counts;
+  std::vector<uint64_t> keys; // keys[i] is counts[i]'s
+
+  MatchCounter(): table(16, Empty), shift(60) {}
+
+  void add(uint64_t key, const char* start, size_t length, uint32_t count) {
+    if ((this->keys.size() + 1) * 2 > this->table.size()) this->grow();
+
+    const size_t mask = this->table.size() - 1;
+    for (size_t i = this->bucket(key); ; i = (i + 1) & mask) {
+      const uint32_t index = this->table[i];
+      if (index == Empty) {
+        this->table[i] = static_cast<uint32_t>(this->keys.size());
+        this->keys.push_back(key);
+        this->counts.push_back(BufferSet::MatchCount(start, length, count));
+        return;
+      }
+      if (this->keys[index] == key) {
+        this->counts[index].count += count;
+        return;
+      }
+    }
+  }
+
+  // Adds rhs's counts, as though rhs's matches came after ours
+  void merge(const MatchCounter& rhs) {
+    for (size_t i = 0; i < rhs.keys.size(); i++) {
+      const BufferSet::MatchCount& c = rhs.counts[i];
+      this->add(rhs.keys[i], c.start, c.length, c.count);
+    }
+  }
+
+private:
+  static const uint32_t Empty = ~static_cast<uint32_t>(0);
+
+  std::vector<uint32_t> table;
+  unsigned shift; // 64 - log2(table.size())
+
+  // Keys may be small integers, so mix them (Fibonacci hashing)
+  size_t bucket(uint64_t key) const { return (key * 0x9e3779b97f4a7c15ull) >> this->shift; }
+
+  void grow() {
+    this->table.assign(this->table.size() * 2, Empty);
+    this->shift--;
+    const size_t mask = this->table.size() - 1;
+    for (size_t index = 0; index < this->keys.size(); index++) {
+      size_t i = this->bucket(this->keys[index]);
+      while (this->table[i] != Empty) i = (i + 1) & mask;
+      this->table[i] = static_cast<uint32_t>(index);
+    }
+  }
+};
+
+const uint32_t MatchCounter::Empty;
+
+std::vector<BufferSet::MatchCount>
+BufferSet::countMatches(const char* s, size_t len, size_t maxNgramSize, size_t nThreads) const {
+  nThreads = threads_for_search(len, nThreads);
+
+  std::vector<MatchCounter> counters(nThreads);
+  this->forEachPiece(s, len, maxNgramSize, nThreads, [&](size_t t, const char* start, size_t length, const char* from) {
+    MatchCounter& counter = counters[t];
+    SearchCounters counted;
+    counted.searches = t == 0 ? 1 : 0;
+    this->forEachMatch(start, length, maxNgramSize, [&](const char* m, size_t l, uint64_t key) {
+      if (from != NULL && m + l <= from) return;
+      counter.add(key, m, l, 1);
+    }, counted);
+    this->record(counted);
+  });
+  for (size_t t = 1; t < nThreads; t++) counters[0].merge(counters[t]);
+
+  MatchCounter& counter = counters[0];
+  if (this->hasIds()) {
+    for (size_t i = 0; i < counter.keys.size(); i++) counter.counts[i].id = this->idOfKey(counter.keys[i]);
+  }
+  return std::move(counter.counts);
+}
+
+void
+BufferSet::keepTop(std::vector<MatchCount>* counts, size_t k) {
+  if (k >= counts->size()) k = counts->size();
+
+  // Ties go to whichever match came first: the one that ends first, and of
+  // those, the longest
+  std::partial_sort(counts->begin(), counts->begin() + k, counts->end(), [](const MatchCount& a, const MatchCount& b) {
+    if (a.count != b.count) return a.count > b.count;
+    const char* aEnd = a.start + a.length;
+    const char* bEnd = b.start + b.length;
+    if (aEnd != bEnd) return aEnd < bEnd;
+    return a.length > b.length;
+  });
+  counts->erase(counts->begin() + k, counts->end());
+}
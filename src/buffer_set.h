@@ -0,0 +1,245 @@
+#ifndef BUFFER_SET_H_
+#define BUFFER_SET_H_
+
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "flat_table.h"
+#include "index_file.h"
+#include "pool_memory.h"
+#include "pooled_string.h"
+#include "search_counters.h"
+#include "token_hash.h"
+#include "tokenizer.h"
+
+class TokenAutomaton;
+
+// Keys are in canonical form (see Tokenizer), so they're words separated by
+// single joiner bytes.
+struct PooledStringTraits {
+  char joiner;
+  token_hash::Family family;
+  char terminator; // '\t' if lines are "key\tid", else '\n'
+
+  explicit PooledStringTraits(char joiner = ' ', token_hash::Family family = token_hash::FarmHash, bool ids = false)
+    : joiner(joiner), family(family), terminator(ids ? '\t' : '\n') {}
+
+  uint64_t hash(const char* s, size_t len) const {
+    return token_hash::hash(this->family, s, len, this->joiner);
+  }
+
+  // Keys are lines, or what comes before the tab
+  bool isTerminator(char c) const { return c == '\n' || c == this->terminator; }
+
+  const char* keyEnd(const char* key, const char* end) const {
+    const char* p = static_cast<const char*>(memchr(key, this->terminator, end - key));
+    return p ? p : end;
+  }
+};
+
+typedef FlatTable<PooledStringTraits> PooledStringTable;
+
+// Identifies PooledStringTraits::hash in index files. Change these whenever
+// the hash changes, or old files will load and then never match anything.
+inline uint32_t
+pooled_string_hash_id(token_hash::Family family) {
+  return family;
+}
+
+// What a BufferSet is built from.
+struct PreparedInput {
+  PoolMemory memory;
+  const index_file::Contents* index; // NULL means memory is newline-separated text
+
+  PreparedInput(): index(NULL) {}
+};
+
+// The number of keys in s, split on separator: the number of separators, plus
+// one if there's anything after the last one.
+size_t count_keys(const char* s, size_t len, char separator);
+
+// The set itself: the keys, the hash table and whatever else we search with.
+// UnorderedBufferSet is the JavaScript face of it.
+//
+// Any number of threads may call the const methods at once. The others must
+// have the set to themselves.
+class BufferSet {
+public:
+  struct Options {
+    // Build a TokenAutomaton and use it for findAllMatches. Slower to build,
+    // faster to search.
+    bool automaton;
+
+    // Copy the input Buffer. If false, we point into the caller's Buffer and
+    // hold a reference to it; the caller must not modify it afterwards.
+    bool copy;
+
+    // How many threads to build the table with. 0 means one per CPU; we
+    // never use more than that, or more than a small input needs.
+    uint32_t threads;
+
+    // How to split keys and documents into words.
+    Tokenizer tokenizer;
+
+    // After building, rewrite the pool to hold only unique keys, and free
+    // the input. With shareSuffixes, a key that ends another key is stored
+    // as a pointer into it.
+    bool compact;
+    bool shareSuffixes;
+
+    // Check a Bloom filter before the table, so most misses never touch it.
+    // With FilterOnly, keep just the filter: less memory, but contains() and
+    // findAllMatches() will sometimes (~1% at 10 bits per key) be wrong.
+    enum Bloom { NoBloom, Prefilter, FilterOnly } bloom;
+    uint32_t bitsPerKey;
+
+    // Map every key to a number. A line may end in a tab and an id; a line
+    // that doesn't gets its row number (from 0). Not with FilterOnly.
+    bool ids;
+
+    // Add up what searches do, for counters(). Each search still counts
+    // for itself; this adds a lock per call.
+    bool counters;
+
+    // Once built, move the keys into a perfect hash table (see
+    // FlatTable::makePerfect()): smaller, and a lookup looks at just one
+    // slot. add() and remove() turn it back into a normal one until the next
+    // compact(). Not with FilterOnly.
+    bool perfectHash;
+
+    Options(): automaton(false), copy(true), threads(1), compact(false), shareSuffixes(false),
+      bloom(NoBloom), bitsPerKey(10), ids(false), counters(false), perfectHash(false) {}
+  };
+
+  // Takes over `input.memory`.
+  BufferSet(PreparedInput& input, const Options& options);
+  ~BufferSet();
+
+  const Options& options() const { return this->builtWith; }
+  bool isFilterOnly() const { return this->filterOnly; }
+  // True if we point into memory somebody else must keep alive.
+  bool isBorrowed() const { return this->memory.isBorrowed(); }
+  bool hasIds() const { return this->builtWith.ids; }
+
+  bool contains(const char* s, size_t len) const;
+  // Splits s like the constructor splits its input (so "a\nb\n" is two keys)
+  // and sets ret[i] to 1 if the i'th key is in the set, 0 otherwise. ret must
+  // have room for count_keys(s, len, separator) bytes.
+  void containsMany(const char* s, size_t len, char separator, uint8_t* ret) const;
+  // With nThreads other than 1 (0 means one per CPU), a long s is split into
+  // pieces, searched at once. Results are the same.
+  std::vector<PooledString> findAllMatches(const char* s, size_t len, size_t maxNgramSize, size_t nThreads = 1) const;
+
+  // With ids: getId() returns false if s isn't a key, and findAllMatchIds()
+  // returns the id of each match findAllMatches() would, in the same order.
+  bool getId(const char* s, size_t len, uint32_t* id) const;
+  std::vector<uint32_t> findAllMatchIds(const char* s, size_t len, size_t maxNgramSize, size_t nThreads = 1) const;
+  // Both at once: appends each match to whichever of matches and ids isn't
+  // NULL.
+  void findMatches(const char* s, size_t len, size_t maxNgramSize,
+      std::vector<PooledString>* matches, std::vector<uint32_t>* ids, size_t nThreads = 1) const;
+
+  // How often each key matched in s: one entry per key, for the first
+  // match, in order. id is 0 without ids. keepTop() keeps the k largest
+  // counts, most first (the first match first, on ties).
+  struct MatchCount {
+    const char* start;
+    size_t length;
+    uint32_t count;
+    uint32_t id;
+
+    MatchCount(const char* start, size_t length, uint32_t count): start(start), length(length), count(count), id(0) {}
+  };
+  std::vector<MatchCount> countMatches(const char* s, size_t len, size_t maxNgramSize, size_t nThreads = 1) const;
+  static void keepTop(std::vector<MatchCount>* counts, size_t k);
+
+  // add() and remove() return false if there was nothing to do. Keys must
+  // not contain '\n' (or, with ids, '\t'). add() ignores id without ids;
+  // addMany() splits each key from its id like the constructor does, and
+  // numbers the rows of s.
+  bool add(const char* s, size_t len, uint32_t id = 0);
+  size_t addMany(const char* s, size_t len, char separator);
+  bool remove(const char* s, size_t len);
+  // Like the compact option, now: also resizes the Bloom filter and rebuilds
+  // the automaton.
+  void compact(bool shareSuffixes);
+
+  // How full the table is and where memory goes. probeLengths[i] is how many
+  // keys a lookup finds at its (i + 1)'th probe.
+  struct Stats {
+    size_t keys;
+    size_t capacity; // slots
+    bool perfectHash; // if the table is perfect right now
+    std::vector<size_t> probeLengths;
+    size_t poolBytes, arenaBytes, tableBytes, bloomBytes, automatonBytes;
+  };
+  Stats stats() const;
+  // Every search's counts so far. All 0 unless built with counters.
+  SearchCounters counters() const;
+
+  // Writes an index file. Returns false and sets errno on failure; `syscall`
+  // names the call that failed. Not for filter-only sets.
+  bool serialize(const char* path, const char** syscall) const;
+
+private:
+  Options builtWith;
+  PooledStringTable set;
+  Tokenizer tokenizer;
+  PoolMemory memory;
+  const char* mem = NULL; // where the keys are: in memory
+  size_t memLength = 0;
+  TokenAutomaton* automaton = NULL;
+  bool wantsAutomaton = false; // if true, we rebuild it after compact()
+  // Keys add()ed since the pool was built. The table sees arena[i] at offset
+  // arenaStart + i; arena[0] is a '\n', so serialize() can write the pool and
+  // the arena back to back.
+  std::vector<char> arena;
+  uint64_t arenaStart = 0;
+  BloomFilter bloom; // empty unless we're using one
+  uint32_t bitsPerKey = 0;
+  bool filterOnly = false; // if true, set is empty and we go by bloom alone
+  mutable std::mutex countersMutex;
+  mutable SearchCounters totals;
+
+  BufferSet(const BufferSet&);
+  BufferSet& operator=(const BufferSet&);
+
+  void canonicalizeText();
+  void compactPool(bool shareSuffixes);
+  void buildFromText();
+  void buildFromTextInParallel(size_t nThreads);
+  void buildFilterFromText();
+  void buildAutomaton();
+  void rebuildBloom();
+  void insert(const char* s, size_t len, uint64_t hash);
+  // Call before changing anything.
+  void prepareToModify();
+  // With ids: what's after the key's tab. The pool holds "key\tid\n".
+  uint32_t idOf(const PooledStringTable::Slot& slot) const;
+  // The key and, with ids, its tab and id.
+  size_t recordLength(const PooledStringTable::Slot& slot) const;
+
+  // Like set.find(), but for any text: s needn't be in canonical form.
+  uint64_t hashKey(const char* s, size_t len) const;
+  const PooledStringTable::Slot* findKey(const char* s, size_t len, uint64_t hash, uint64_t* probes = NULL) const;
+  // Like findKey(), but asks the Bloom filter first
+  bool hasKey(const char* s, size_t len, uint64_t hash, SearchCounters& counters) const;
+  // Adds what a search counted to totals, if we're counting
+  void record(const SearchCounters& counters) const;
+  bool passesFilter(uint64_t hash) const { return this->bloom.empty() || this->bloom.mayContain(hash); }
+  // Starts loading whatever a lookup of this hash will look at first
+  void prefetch(uint64_t hash) const;
+  // With ids: the id of the key forEachMatch() called `key`
+  uint32_t idOfKey(uint64_t key) const;
+  template<typename F> void forEachMatch(const char* s, size_t len, size_t maxNgramSize, F f,
+      SearchCounters& counters) const;
+  template<size_t N, typename F> void forEachNgramMatch(const char* s, size_t len, size_t maxNgramSize, F f,
+      SearchCounters& counters) const;
+  template<typename F> void forEachPiece(const char* s, size_t len, size_t maxNgramSize, size_t nThreads, F f) const;
+};
+
+#endif  // BUFFER_SET_H_
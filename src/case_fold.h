@@ -0,0 +1,159 @@
+#ifndef CASE_FOLD_H_
+#define CASE_FOLD_H_
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+// Case folding that never changes a string's length, so a folded key and the
+// original text line up byte for byte.
+//
+// Ascii folds 'A'-'Z' to 'a'-'z', 16 bytes at a time. Utf8 also applies
+// Unicode simple case folding to the two-byte UTF-8 characters that fold to
+// two-byte characters: Latin-1, Latin Extended-A, Greek, Cyrillic and
+// Armenian. Folds that change a character's length (e.g., 'ß' to "ss", or
+// the Kelvin sign to 'k') aren't applied, and invalid UTF-8 passes through.
+namespace case_fold {
+
+enum Mode {
+  None = 0,
+  Ascii = 1,
+  Utf8 = 2
+};
+
+inline char
+fold_ascii_byte(char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// out may equal s.
+inline void
+fold_ascii(const char* s, size_t len, char* out) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // Flip the sign bit so signed comparisons work on unsigned bytes.
+  const __m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+  const __m128i aMinus1 = _mm_set1_epi8(static_cast<char>(('A' - 1) ^ 0x80));
+  const __m128i zPlus1 = _mm_set1_epi8(static_cast<char>(('Z' + 1) ^ 0x80));
+  const __m128i delta = _mm_set1_epi8('a' - 'A');
+  for (; i + 16 <= len; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    const __m128i x = _mm_xor_si128(v, flip);
+    const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, aMinus1), _mm_cmplt_epi8(x, zPlus1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi8(v, _mm_and_si128(upper, delta)));
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint8x16_t a = vdupq_n_u8('A');
+  const uint8x16_t z = vdupq_n_u8('Z');
+  const uint8x16_t delta = vdupq_n_u8('a' - 'A');
+  for (; i + 16 <= len; i += 16) {
+    const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i));
+    const uint8x16_t upper = vandq_u8(vcgeq_u8(v, a), vcleq_u8(v, z));
+    vst1q_u8(reinterpret_cast<uint8_t*>(out + i), vaddq_u8(v, vandq_u8(upper, delta)));
+  }
+#endif
+
+  for (; i < len; i++) out[i] = fold_ascii_byte(s[i]);
+}
+
+// Simple case folding for a code point in [0x80,0x800). The result is in the
+// same range.
+inline uint32_t
+fold_two_byte_code_point(uint32_t c) {
+  if (c < 0x100) {
+    if (c == 0xb5) return 0x3bc; // micro sign
+    return c >= 0xc0 && c <= 0xde && c != 0xd7 ? c + 0x20 : c;
+  }
+  if (c < 0x180) {
+    if (c == 0x178) return 0xff;
+    if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e)) return c & 1 ? c + 1 : c;
+    if (c <= 0x12f || (c >= 0x132 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) return c | 1;
+    return c;
+  }
+  if (c >= 0x386 && c <= 0x3ab) {
+    if (c == 0x386) return 0x3ac;
+    if (c >= 0x388 && c <= 0x38a) return c + 37;
+    if (c == 0x38c) return 0x3cc;
+    if (c == 0x38e || c == 0x38f) return c + 63;
+    if (c >= 0x391 && c != 0x3a2) return c + 0x20;
+    return c;
+  }
+  if (c == 0x3c2) return 0x3c3; // final sigma
+  if (c >= 0x3d8 && c <= 0x3ef) return c | 1;
+  if (c >= 0x400 && c <= 0x52f) {
+    if (c < 0x410) return c + 0x50;
+    if (c < 0x430) return c + 0x20;
+    if (c == 0x4c0) return 0x4cf;
+    if (c >= 0x4c1 && c <= 0x4ce) return c & 1 ? c + 1 : c;
+    if ((c >= 0x460 && c <= 0x481) || c >= 0x48a) return c | 1;
+    return c;
+  }
+  if (c >= 0x531 && c <= 0x556) return c + 0x30;
+  return c;
+}
+
+// out may equal s.
+inline void
+fold_utf8(const char* s, size_t len, char* out) {
+  size_t i = 0;
+  while (i < len) {
+    // Most text is mostly ASCII: fold runs of it with SIMD.
+    size_t run = i;
+    while (run < len && static_cast<unsigned char>(s[run]) < 0x80) run++;
+    fold_ascii(s + i, run - i, out + i);
+    i = run;
+    if (i == len) break;
+
+    const unsigned char lead = static_cast<unsigned char>(s[i]);
+    if (lead >= 0xc2 && lead <= 0xdf && i + 1 < len && (static_cast<unsigned char>(s[i + 1]) & 0xc0) == 0x80) {
+      const uint32_t c = fold_two_byte_code_point(((lead & 0x1f) << 6) | (static_cast<unsigned char>(s[i + 1]) & 0x3f));
+      out[i] = static_cast<char>(0xc0 | (c >> 6));
+      out[i + 1] = static_cast<char>(0x80 | (c & 0x3f));
+      i += 2;
+    } else {
+      out[i] = s[i];
+      i++;
+    }
+  }
+}
+
+// out may equal s.
+inline void
+fold(Mode mode, const char* s, size_t len, char* out) {
+  switch (mode) {
+    case None: if (out != s) memmove(out, s, len); break;
+    case Ascii: fold_ascii(s, len, out); break;
+    case Utf8: fold_utf8(s, len, out); break;
+  }
+}
+
+// True if fold(s[0,len)) is folded[0,len). Doesn't allocate.
+inline bool
+folded_equals(Mode mode, const char* s, const char* folded, size_t len) {
+  if (mode == None) return memcmp(s, folded, len) == 0;
+
+  char buf[64];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    // Don't split a two-byte character between blocks.
+    if (mode == Utf8 && n < len && static_cast<unsigned char>(s[n - 1]) >= 0xc0) n--;
+    fold(mode, s, n, buf);
+    if (memcmp(buf, folded, n) != 0) return false;
+    s += n;
+    folded += n;
+    len -= n;
+  }
+  return true;
+}
+
+}  // namespace case_fold
+
+#endif  // CASE_FOLD_H_
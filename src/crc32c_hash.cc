@@ -0,0 +1,166 @@
+#include "crc32c_hash.h"
+
+#include <cstring>
+
+#include "token_hash.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#  define CRC32C_HASH_X86 1
+#  include <nmmintrin.h>
+#endif
+
+namespace {
+
+const uint32_t SeedA = 0x9e3779b9;
+const uint32_t SeedB = 0x85ebca6b;
+const uint64_t K1 = 0xc2b2ae3d27d4eb4fULL;
+const uint64_t K2 = 0x165667b19e3779f9ULL;
+
+inline uint64_t
+load64(const char* p) {
+  uint64_t ret;
+  memcpy(&ret, p, sizeof(ret));
+  return ret;
+}
+
+inline uint64_t
+load32(const char* p) {
+  uint32_t ret;
+  memcpy(&ret, p, sizeof(ret));
+  return ret;
+}
+
+inline uint64_t
+rotate(uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
+
+// CRC32C is linear, so lanes over the same words would be views of the same
+// 32 bits. Lanes c and d see sums of words, and carries aren't linear over
+// GF(2), so together the lanes carry 64 bits and more. Each lane is its own
+// dependency chain, so the CPU runs all four at once.
+template<typename Crc> inline uint64_t
+hash_with(const char* s, size_t len) {
+  uint32_t a = SeedA, b = SeedB, c = SeedA, d = SeedB;
+
+  if (len <= 16) {
+    // Short keys: two (possibly overlapping) loads cover every byte.
+    uint64_t x, y;
+    if (len >= 8) {
+      x = load64(s);
+      y = load64(s + len - 8);
+    } else if (len >= 4) {
+      x = load32(s);
+      y = load32(s + len - 4);
+    } else if (len > 0) {
+      const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+      x = (static_cast<uint64_t>(u[0]) << 16) | (static_cast<uint64_t>(u[len / 2]) << 8) | u[len - 1];
+      y = 0;
+    } else {
+      x = y = 0;
+    }
+    a = Crc::u64(a, x);
+    b = Crc::u64(b, y);
+    c = Crc::u64(c, x + y);
+    d = Crc::u64(d, x + rotate(y, 29));
+  } else {
+    const char* end = s + len;
+    for (; s + 16 < end; s += 16) {
+      const uint64_t x = load64(s);
+      const uint64_t y = load64(s + 8);
+      a = Crc::u64(a, x);
+      b = Crc::u64(b, y);
+      c = Crc::u64(c, x + y);
+      d = Crc::u64(d, x + rotate(y, 29));
+    }
+    // The last 16 bytes, overlapping what we've already seen
+    const uint64_t x = load64(end - 16);
+    const uint64_t y = load64(end - 8);
+    a = Crc::u64(a, x);
+    b = Crc::u64(b, y);
+    c = Crc::u64(c, x + y);
+    d = Crc::u64(d, x + rotate(y, 29));
+  }
+
+  const uint64_t ab = (static_cast<uint64_t>(a) << 32) | b;
+  const uint64_t cd = (static_cast<uint64_t>(c) << 32) | d;
+  return token_hash::mum(token_hash::mum(ab ^ K1, cd ^ K2), len ^ K1);
+}
+
+struct SoftwareCrc {
+  static uint32_t table[256];
+
+  static bool init() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      table[i] = crc;
+    }
+    return true;
+  }
+
+  // Same result as _mm_crc32_u64
+  static uint32_t u64(uint32_t crc, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+      crc = table[(crc ^ v) & 0xff] ^ (crc >> 8);
+      v >>= 8;
+    }
+    return crc;
+  }
+};
+
+uint32_t SoftwareCrc::table[256];
+
+uint64_t
+hash_software(const char* s, size_t len) {
+  return hash_with<SoftwareCrc>(s, len);
+}
+
+#ifdef CRC32C_HASH_X86
+struct Sse42Crc {
+  __attribute__((target("sse4.2"))) static inline uint32_t u64(uint32_t crc, uint64_t v) {
+#  if defined(__x86_64__)
+    return static_cast<uint32_t>(_mm_crc32_u64(crc, v));
+#  else
+    return _mm_crc32_u32(_mm_crc32_u32(crc, static_cast<uint32_t>(v)), static_cast<uint32_t>(v >> 32));
+#  endif
+  }
+};
+
+// flatten: inline everything, so the CRC instructions land in this function,
+// which is the only one allowed to use them.
+__attribute__((target("sse4.2"), flatten)) uint64_t
+hash_sse42(const char* s, size_t len) {
+  return hash_with<Sse42Crc>(s, len);
+}
+#endif
+
+typedef uint64_t (*HashFunction)(const char* s, size_t len);
+
+HashFunction
+choose_hash_function() {
+  SoftwareCrc::init();
+#ifdef CRC32C_HASH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) return hash_sse42;
+#endif
+  return hash_software;
+}
+
+const HashFunction chosenHashFunction = choose_hash_function();
+
+}  // namespace
+
+namespace crc32c_hash {
+
+bool
+isAccelerated() {
+  return chosenHashFunction != hash_software;
+}
+
+uint64_t
+hash(const char* s, size_t len) {
+  return chosenHashFunction(s, len);
+}
+
+}  // namespace crc32c_hash
@@ -0,0 +1,26 @@
+#ifndef CRC32C_HASH_H_
+#define CRC32C_HASH_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+// A 64-bit hash built from CRC32C, which x86 CPUs with SSE4.2 compute in
+// hardware at about a cycle per 8 bytes.
+//
+// Four CRC lanes run side by side, so on long keys (a couple hundred bytes
+// and up) this beats Fingerprint64. Short keys are faster with a plain
+// multiply: see token_hash::short_token().
+//
+// We pick the hardware or software (lookup table) implementation once, at
+// startup, by asking the CPU. Both give the same answer, so an index file
+// written on one machine works on any other.
+namespace crc32c_hash {
+
+// True if hash() uses CRC32C instructions rather than a lookup table.
+bool isAccelerated();
+
+uint64_t hash(const char* s, size_t len);
+
+}  // namespace crc32c_hash
+
+#endif  // CRC32C_HASH_H_
@@ -0,0 +1,609 @@
+#ifndef FLAT_TABLE_H_
+#define FLAT_TABLE_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// A flat, open-addressing hash set of strings that live in a single pool.
+//
+// std::unordered_set allocates a node per key and chases a bucket pointer,
+// then a node pointer, then the string pointer. Here every key is one 8-byte
+// Slot in one contiguous array: a lookup touches the slot's cache line and
+// then the string bytes, and nothing else.
+//
+// A Slot doesn't store its key's length. Keys in the pool end with a
+// terminator byte (or the end of the pool), so we check that the byte after
+// a candidate match is a terminator instead. That halves the table, and
+// checking costs nothing: it's on the same cache line as the key.
+//
+// We use Robin Hood linear probing: each slot remembers how far it is from its
+// home bucket, and inserts steal slots from keys that are closer to home. That
+// keeps probe sequences short at a high load factor and lets a miss stop as
+// soon as it sees a key that's closer to home than the needle would be.
+//
+// A table that won't change again can trade all that for a perfect hash
+// function (see makePerfect()): every key gets a slot of its own, so a lookup
+// reads one 2-byte pilot and one slot, and the table is ~98% full.
+//
+// The table never owns the strings. It stores offsets from `base`, which the
+// caller must keep alive. Keys added after the pool was built can live in a
+// second region, the arena: offsets from arenaStart up point there. Traits
+// tells us where keys end, and how to hash a pooled key when we need to
+// rehash:
+//
+//     struct Traits {
+//       uint64_t hash(const char* s, size_t len) const;
+//       bool isTerminator(char c) const;
+//       // The first terminator at or after key, or end
+//       const char* keyEnd(const char* key, const char* end) const;
+//     };
+template<typename Traits>
+class FlatTable {
+public:
+  struct Slot {
+    // 0 means empty. Otherwise, (offset from base << 24) | (16-bit
+    // fingerprint << 8) | (distance + 1). So the pool can be up to 1TB.
+    uint64_t bits;
+
+    uint64_t offset() const { return this->bits >> OffsetShift; }
+  };
+
+  explicit FlatTable(const Traits& traits = Traits())
+    : traits(traits), base(NULL), poolEnd(NULL), arena(NULL), arenaEnd(NULL), arenaStart(NoArena),
+      slots(NULL), nSlots(0), mask(0), count(0), ownsSlots(true), pilots(NULL), nBuckets(0), seed(0) {}
+
+  ~FlatTable() {
+    if (this->slots && this->ownsSlots) free(this->slots);
+    if (this->pilots && this->ownsSlots) free(this->pilots);
+  }
+
+  // Sets the pool all keys live in.
+  void setBase(const char* base, size_t length) {
+    this->base = base;
+    this->poolEnd = base + length;
+  }
+
+  // Sets where keys at offsets >= start live: offset start is arena[0]. The
+  // arena may move (say, as it grows) as long as you call this again.
+  void setArena(const char* arena, size_t length, uint64_t start) {
+    this->arena = arena;
+    this->arenaEnd = arena + length;
+    this->arenaStart = start;
+  }
+
+  size_t size() const { return this->count; }
+  size_t capacity() const { return this->slots ? this->nSlots : 0; }
+  size_t memoryUsage() const { return this->capacity() * sizeof(Slot) + this->nBuckets * sizeof(uint16_t); }
+  bool isPerfect() const { return this->pilots != NULL; }
+
+  const char* keyData(const Slot& slot) const { return this->at(slot.offset()); }
+
+  // Finds the key's terminator, so it reads the whole key.
+  size_t keyLength(const Slot& slot) const {
+    const char* key = this->keyData(slot);
+    return this->traits.keyEnd(key, this->regionEnd(slot.offset())) - key;
+  }
+
+  // The slot array and, with a perfect hash, its pilots, for writing to disk.
+  const Slot* rawSlots() const { return this->slots; }
+  const uint16_t* rawPilots() const { return this->pilots; }
+  size_t bucketCount() const { return this->nBuckets; }
+  uint64_t perfectSeed() const { return this->seed; }
+
+  // Uses somebody else's slot array (e.g., a mapped index file) instead of
+  // our own. It must stay alive and unchanged, and we won't write to it: the
+  // table must not be modified afterwards. Pass the pilots, bucket count and
+  // seed of a perfect layout too, if it is one.
+  void borrowSlots(const Slot* slots, size_t capacity, size_t count,
+      const uint16_t* pilots = NULL, size_t nBuckets = 0, uint64_t seed = 0) {
+    this->freeSlots();
+    this->slots = const_cast<Slot*>(slots);
+    this->nSlots = capacity;
+    this->mask = capacity - 1;
+    this->count = count;
+    this->ownsSlots = false;
+    this->pilots = const_cast<uint16_t*>(pilots);
+    this->nBuckets = pilots ? nBuckets : 0;
+    this->seed = seed;
+  }
+
+  // Copies borrowed slots, so we can modify them. A perfect layout can't
+  // take another key, so this turns it back into a Robin Hood table.
+  void ownSlots() {
+    if (this->pilots) {
+      if (this->ownsSlots) free(this->pilots);
+      this->pilots = NULL;
+      this->nBuckets = 0;
+      this->rehash(capacityFor(this->count));
+      return;
+    }
+    if (this->ownsSlots || this->slots == NULL) return;
+    Slot* slots = static_cast<Slot*>(malloc(this->capacity() * sizeof(Slot)));
+    memcpy(slots, this->slots, this->capacity() * sizeof(Slot));
+    this->slots = slots;
+    this->ownsSlots = true;
+  }
+
+  // Forgets all keys, and frees the slots.
+  void clear() {
+    this->freeSlots();
+    this->slots = NULL;
+    this->nSlots = 0;
+    this->mask = 0;
+    this->count = 0;
+    this->ownsSlots = true;
+  }
+
+  // Makes room for n keys without rehashing.
+  void reserve(size_t n) {
+    const size_t wanted = capacityFor(n);
+    if (wanted > this->capacity()) this->rehash(wanted);
+  }
+
+  // Moves every key to the slot a minimal-ish perfect hash function picks
+  // for it, PTHash style: keys are split into buckets of ~4, and each bucket
+  // gets the first 16-bit "pilot" that sends all its keys to free slots,
+  // biggest buckets first. A lookup hashes to a bucket, reads its pilot and
+  // then the one slot the key can be in. There are 1/64 more slots than
+  // keys, so there are always a few free ones to aim for; the pilots add 4
+  // bits per key.
+  //
+  // The table can't be modified while it's perfect (see ownSlots()). Returns
+  // false, and leaves the table as it was, if no pilots fit (two keys with the
+  // same 64-bit hash, say).
+  bool makePerfect() {
+    const size_t n = this->count;
+    if (n == 0 || n > MaxPerfectKeys) return false;
+
+    std::vector<PerfectKey> keys;
+    keys.reserve(n);
+    this->forEach([this, &keys](const Slot& slot) {
+      PerfectKey key = { this->hashOf(slot), rehome(slot).bits };
+      keys.push_back(key);
+    });
+
+    const size_t nSlots = n + n / 64 + 1;
+    const size_t nBuckets = n / AverageBucketSize + 1;
+    std::vector<uint16_t> pilots(nBuckets);
+    std::vector<uint32_t> slotOf(n);
+    uint64_t seed = 0;
+    for (uint64_t attempt = 1; ; attempt++) {
+      if (attempt > MaxPerfectAttempts) return false;
+      seed = mix(attempt);
+      if (findPilots(keys, seed, nSlots, nBuckets, &pilots, &slotOf)) break;
+    }
+
+    Slot* slots = static_cast<Slot*>(calloc(nSlots, sizeof(Slot)));
+    for (size_t i = 0; i < n; i++) slots[slotOf[i]].bits = keys[i].bits;
+
+    this->freeSlots();
+    this->slots = slots;
+    this->nSlots = nSlots;
+    this->mask = 0;
+    this->ownsSlots = true;
+    this->pilots = static_cast<uint16_t*>(malloc(nBuckets * sizeof(uint16_t)));
+    memcpy(this->pilots, pilots.data(), nBuckets * sizeof(uint16_t));
+    this->nBuckets = nBuckets;
+    this->seed = seed;
+    return true;
+  }
+
+  // Adds the key at base[offset,offset+length). Returns false if an equal key
+  // is already in the table.
+  bool insert(uint64_t offset, size_t length, uint64_t hash) {
+    if (this->find(this->at(offset), length, hash) != NULL) return false;
+    this->insertNew(offset, hash);
+    return true;
+  }
+
+  // Like insert(), for a key we know isn't in the table.
+  void insertNew(uint64_t offset, uint64_t hash) {
+    if (this->count + 1 > this->capacity() - this->capacity() / MaxLoadDenominator) {
+      this->rehash(this->capacity() ? this->capacity() * 2 : 16);
+    }
+
+    this->insertUnique(makeSlot(offset, hash), hash);
+    this->count++;
+  }
+
+  // Removes the key find() returned. Rather than leave a tombstone, we shift
+  // the keys after it back by one until one is at home: the table looks
+  // exactly as if the key had never been inserted. The table must own its
+  // slots, and not be perfect.
+  void erase(const Slot* slot) {
+    size_t i = slot - this->slots;
+    while (true) {
+      const size_t next = (i + 1) & this->mask;
+      if ((this->slots[next].bits & DistanceMask) <= 1) break; // empty, or at home
+      this->slots[i].bits = this->slots[next].bits - 1;
+      i = next;
+    }
+    this->slots[i].bits = 0;
+    this->count--;
+  }
+
+  // Starts loading the first slot find() would look at for this hash. A batch
+  // of prefetch() calls followed by a batch of find() calls waits for one
+  // cache miss at a time instead of one per find().
+  void prefetch(uint64_t hash) const {
+#if defined(__GNUC__)
+    if (this->pilots) {
+      __builtin_prefetch(&this->pilots[bucketOf(hash, this->seed, this->nBuckets)]);
+    } else if (this->slots) {
+      __builtin_prefetch(&this->slots[hash & this->mask]);
+    }
+#endif
+  }
+
+  // Returns the slot whose key equals s[0,len), or NULL. If probes isn't
+  // NULL, adds the number of slots we looked at.
+  const Slot* find(const char* s, size_t len, uint64_t hash, uint64_t* probes = NULL) const {
+    return this->findSlot(hash, [this, s, len](const Slot& slot) {
+      return this->keyEquals(slot, s, len);
+    }, probes);
+  }
+
+  // Returns the slot for which equal(keyData, keyLength) is true, or NULL.
+  // Use this when the needle isn't one contiguous string that's byte-for-byte
+  // like the key.
+  template<typename Equal> const Slot* find(uint64_t hash, Equal equal, uint64_t* probes = NULL) const {
+    return this->findSlot(hash, [this, &equal](const Slot& slot) {
+      return equal(this->keyData(slot), this->keyLength(slot));
+    }, probes);
+  }
+
+  // A key that's waiting to be inserted, for building in parallel.
+  struct Entry {
+    uint64_t offset;
+    uint64_t hash;
+    size_t length;
+  };
+
+  // Inserts the entries whose home bucket is in [begin,end) -- skipping the
+  // rest -- without reading or writing any slot outside [begin,end). That
+  // makes it safe to call concurrently on disjoint ranges, as long as nothing
+  // else touches the table. reserve() first.
+  //
+  // A key that would have to be moved past `end` goes into `overflow`
+  // instead; insert() those once all ranges are done. Returns the number of
+  // keys added; pass the total to addCount().
+  size_t insertInRange(const Entry* entries, size_t n, size_t begin, size_t end, std::vector<Entry>* overflow) {
+    size_t ret = 0;
+
+    for (size_t e = 0; e < n; e++) {
+      const Entry& entry = entries[e];
+      size_t i = entry.hash & this->mask;
+      if (i < begin || i >= end) continue;
+
+      Slot slot = makeSlot(entry.offset, entry.hash);
+      bool mightBeDuplicate = true; // until we steal a slot, by Robin Hood order
+
+      while (true) {
+        if (i == end || (slot.bits & DistanceMask) == DistanceMask) {
+          // Whatever we're carrying (the entry or a key it displaced) isn't in
+          // the table any more. insert() will count it.
+          Entry spilled = { slot.offset(), this->hashOf(slot), this->keyLength(slot) };
+          overflow->push_back(spilled);
+          break;
+        }
+
+        Slot& cur = this->slots[i];
+        if (cur.bits == 0) {
+          cur = slot;
+          ret++;
+          break;
+        }
+
+        if (mightBeDuplicate
+            && (cur.bits & FingerprintMask) == (slot.bits & FingerprintMask)
+            && this->keyEquals(cur, this->at(entry.offset), entry.length)) {
+          break;
+        }
+
+        if ((cur.bits & DistanceMask) < (slot.bits & DistanceMask)) {
+          std::swap(cur, slot);
+          mightBeDuplicate = false;
+        }
+
+        i++;
+        slot.bits++;
+      }
+    }
+
+    return ret;
+  }
+
+  void addCount(size_t n) { this->count += n; }
+
+  // Moves every key to a new pool: f(const Slot&) returns the key's offset in
+  // it. f can still read keys at their old offsets. The table must own its
+  // slots.
+  template<typename F> void rebase(const char* base, size_t length, F f) {
+    const size_t n = this->capacity();
+    for (size_t i = 0; i < n; i++) {
+      Slot& slot = this->slots[i];
+      if (slot.bits != 0) slot.bits = (static_cast<uint64_t>(f(static_cast<const Slot&>(slot))) << OffsetShift) | (slot.bits & (FingerprintMask | DistanceMask));
+    }
+    this->setBase(base, length);
+    this->setArena(NULL, 0, NoArena);
+  }
+
+  // Hashes the slot's key again.
+  uint64_t hashOf(const Slot& slot) const {
+    return this->traits.hash(this->keyData(slot), this->keyLength(slot));
+  }
+
+  // How many slots a lookup of this key looks at: 1 if it's in its home
+  // bucket.
+  static size_t probeLength(const Slot& slot) { return slot.bits & DistanceMask; }
+
+  // Calls f(const Slot&) for every key, in table order.
+  template<typename F> void forEach(F f) const {
+    const size_t n = this->capacity();
+    for (size_t i = 0; i < n; i++) {
+      if (this->slots[i].bits != 0) f(this->slots[i]);
+    }
+  }
+
+private:
+  static const uint64_t DistanceMask = 0xff;
+  static const uint64_t FingerprintMask = 0xffff00;
+  static const int OffsetShift = 24;
+  static const size_t MaxLoadDenominator = 8; // max load is 7/8
+  static const uint64_t NoArena = ~static_cast<uint64_t>(0);
+  static const size_t AverageBucketSize = 4;
+  static const size_t MaxPerfectAttempts = 8; // seeds to try
+  static const size_t MaxPilot = 0xffff;
+  // Slot and bucket numbers are 32 bits
+  static const size_t MaxPerfectKeys = 0xfc000000;
+
+  Traits traits;
+  const char* base;
+  const char* poolEnd;
+  const char* arena;
+  const char* arenaEnd;
+  uint64_t arenaStart;
+  Slot* slots;
+  size_t nSlots;
+  size_t mask; // nSlots - 1, unless we're perfect
+  size_t count;
+  bool ownsSlots; // and pilots
+  // A perfect layout's pilot for each bucket, or NULL
+  uint16_t* pilots;
+  size_t nBuckets;
+  uint64_t seed;
+
+  struct PerfectKey {
+    uint64_t hash;
+    uint64_t bits; // its slot, at home
+  };
+
+  FlatTable(const FlatTable&);
+  FlatTable& operator=(const FlatTable&);
+
+  void freeSlots() {
+    if (this->ownsSlots) {
+      free(this->slots);
+      free(this->pilots);
+    }
+    this->pilots = NULL;
+    this->nBuckets = 0;
+  }
+
+  const char* at(uint64_t offset) const {
+    return offset < this->arenaStart ? this->base + offset : this->arena + (offset - this->arenaStart);
+  }
+
+  // Where the key at this offset must end by
+  const char* regionEnd(uint64_t offset) const {
+    return offset < this->arenaStart ? this->poolEnd : this->arenaEnd;
+  }
+
+  static uint64_t metaFor(uint64_t hash) {
+    // Use the top bits as the fingerprint: the bottom bits pick the bucket, so
+    // they'd tell us nothing about keys that share a bucket.
+    return ((hash >> 48) << 8) | 1;
+  }
+
+  static Slot makeSlot(uint64_t offset, uint64_t hash) {
+    Slot ret = { (offset << OffsetShift) | metaFor(hash) };
+    return ret;
+  }
+
+  // True if the slot's key is s[0,len): the bytes match and the key ends
+  // right after them. It can't end before them: an s with a terminator in it
+  // would match the key and the lines after it.
+  bool keyEquals(const Slot& slot, const char* s, size_t len) const {
+    const char* key = this->keyData(slot);
+    const char* end = this->regionEnd(slot.offset());
+    if (static_cast<size_t>(end - key) < len || memcmp(key, s, len) != 0) return false;
+    if (this->traits.keyEnd(key, key + len) != key + len) return false;
+    return key + len == end || this->traits.isTerminator(key[len]);
+  }
+
+  // Calls matches(slot) on each slot whose fingerprint matches the hash's,
+  // in probe order, until it returns true.
+  template<typename Matches> const Slot* findSlot(uint64_t hash, Matches matches, uint64_t* probes) const {
+    if (this->count == 0) return NULL;
+
+    if (this->pilots) {
+      const Slot& slot = this->slots[this->perfectSlot(hash)];
+      if (probes) (*probes)++;
+      // Distance is always 1, and an empty slot's is 0
+      return slot.bits != 0 && (slot.bits & FingerprintMask) == (metaFor(hash) & FingerprintMask) && matches(slot) ? &slot : NULL;
+    }
+
+    const uint64_t fingerprint = metaFor(hash) & FingerprintMask;
+    size_t i = hash & this->mask;
+
+    for (uint64_t distance = 1; ; distance++) {
+      const Slot& slot = this->slots[i];
+
+      // Empty, or a key that's closer to its home than we'd be: in Robin Hood
+      // order, our key would have stolen this slot.
+      if ((slot.bits & DistanceMask) < distance) {
+        if (probes) *probes += distance;
+        return NULL;
+      }
+
+      if ((slot.bits & FingerprintMask) == fingerprint && matches(slot)) {
+        if (probes) *probes += distance;
+        return &slot;
+      }
+
+      i = (i + 1) & this->mask;
+    }
+  }
+
+  // Inserts a slot whose key we know isn't in the table yet. Its distance
+  // must be 1 (i.e., "at home").
+  void insertUnique(Slot slot, uint64_t hash) {
+    size_t i = hash & this->mask;
+
+    while (true) {
+      Slot& cur = this->slots[i];
+      if (cur.bits == 0) {
+        cur = slot;
+        return;
+      }
+
+      if ((cur.bits & DistanceMask) < (slot.bits & DistanceMask)) {
+        std::swap(cur, slot);
+      }
+
+      i = (i + 1) & this->mask;
+      slot.bits++;
+
+      if ((slot.bits & DistanceMask) == DistanceMask) {
+        // A probe sequence this long means a terrible hash distribution. Grow
+        // and put the displaced key back, wherever it is in the table now.
+        this->rehash(this->capacity() * 2);
+        this->insertUnique(this->rehome(slot), this->hashOf(slot));
+        return;
+      }
+    }
+  }
+
+  static size_t capacityFor(size_t n) {
+    size_t ret = 16;
+    while (ret - ret / MaxLoadDenominator < n) ret <<= 1;
+    return ret;
+  }
+
+  // murmur3's finalizer: every input bit flips each output bit half the time
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  // x in [0,2^32) scaled to [0,n), without a division
+  static size_t scale(uint64_t x, size_t n) { return static_cast<size_t>((x * n) >> 32); }
+
+  // 60% of keys go to the first 30% of buckets. Uneven buckets fill faster:
+  // the big ones get placed while the table is still empty (PTHash's trick).
+  static size_t bucketOf(uint64_t hash, uint64_t seed, size_t nBuckets) {
+    const uint64_t h = (hash ^ seed) * 0x9e3779b97f4a7c15ULL; // low bits up
+    const size_t dense = nBuckets * 3 / 10;
+    const uint64_t lo = h & 0xffffffff;
+    return (h >> 32) < 0x9999999aULL ? scale(lo, dense) : dense + scale(lo, nBuckets - dense);
+  }
+
+  static size_t slotFor(uint64_t hash, uint64_t pilot, uint64_t seed, size_t nSlots) {
+    return scale(mix(hash ^ seed ^ (pilot * 0x9e3779b97f4a7c15ULL)) >> 32, nSlots);
+  }
+
+  size_t perfectSlot(uint64_t hash) const {
+    return slotFor(hash, this->pilots[bucketOf(hash, this->seed, this->nBuckets)], this->seed, this->nSlots);
+  }
+
+  // makePerfect()'s search: sets pilots and each key's slot.
+  static bool findPilots(const std::vector<PerfectKey>& keys, uint64_t seed, size_t nSlots, size_t nBuckets,
+      std::vector<uint16_t>* pilots, std::vector<uint32_t>* slotOf) {
+    const size_t n = keys.size();
+
+    // Sort keys by bucket, and buckets by size, biggest first
+    std::vector<uint32_t> bucketStart(nBuckets + 1, 0);
+    std::vector<uint32_t> bucketOfKey(n);
+    for (size_t i = 0; i < n; i++) {
+      bucketOfKey[i] = bucketOf(keys[i].hash, seed, nBuckets);
+      bucketStart[bucketOfKey[i] + 1]++;
+    }
+    size_t maxBucketSize = 0;
+    for (size_t b = 0; b < nBuckets; b++) {
+      maxBucketSize = std::max<size_t>(maxBucketSize, bucketStart[b + 1]);
+      bucketStart[b + 1] += bucketStart[b];
+    }
+    std::vector<uint32_t> byBucket(n);
+    std::vector<uint32_t> next(bucketStart.begin(), bucketStart.end() - 1);
+    for (size_t i = 0; i < n; i++) byBucket[next[bucketOfKey[i]]++] = i;
+
+    std::vector<uint32_t> sizeStart(maxBucketSize + 2, 0);
+    for (size_t b = 0; b < nBuckets; b++) sizeStart[maxBucketSize - (bucketStart[b + 1] - bucketStart[b]) + 1]++;
+    for (size_t s = 0; s <= maxBucketSize; s++) sizeStart[s + 1] += sizeStart[s];
+    std::vector<uint32_t> order(nBuckets);
+    for (size_t b = 0; b < nBuckets; b++) order[sizeStart[maxBucketSize - (bucketStart[b + 1] - bucketStart[b])]++] = b;
+
+    std::vector<uint64_t> taken((nSlots + 63) / 64, 0);
+    std::vector<size_t> candidates(maxBucketSize);
+    for (size_t o = 0; o < nBuckets; o++) {
+      const size_t b = order[o];
+      const uint32_t* bucket = &byBucket[bucketStart[b]];
+      const size_t size = bucketStart[b + 1] - bucketStart[b];
+      if (size == 0) break; // and so are the rest
+
+      uint64_t pilot = 0;
+      for (; pilot <= MaxPilot; pilot++) {
+        size_t k = 0;
+        for (; k < size; k++) {
+          const size_t slot = slotFor(keys[bucket[k]].hash, pilot, seed, nSlots);
+          if (taken[slot / 64] & (static_cast<uint64_t>(1) << (slot % 64))) break;
+          if (std::find(candidates.begin(), candidates.begin() + k, slot) != candidates.begin() + k) break;
+          candidates[k] = slot;
+        }
+        if (k == size) break;
+      }
+      if (pilot > MaxPilot) return false;
+
+      (*pilots)[b] = static_cast<uint16_t>(pilot);
+      for (size_t k = 0; k < size; k++) {
+        taken[candidates[k] / 64] |= static_cast<uint64_t>(1) << (candidates[k] % 64);
+        (*slotOf)[bucket[k]] = candidates[k];
+      }
+    }
+    return true;
+  }
+
+  static Slot rehome(Slot slot) {
+    slot.bits = (slot.bits & ~DistanceMask) | 1;
+    return slot;
+  }
+
+  void rehash(size_t newCapacity) {
+    Slot* oldSlots = this->slots;
+    const size_t oldCapacity = this->capacity();
+    const bool ownedOldSlots = this->ownsSlots;
+
+    this->ownsSlots = true;
+    this->slots = static_cast<Slot*>(calloc(newCapacity, sizeof(Slot)));
+    this->nSlots = newCapacity;
+    this->mask = newCapacity - 1;
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+      if (oldSlots[i].bits != 0) {
+        this->insertUnique(rehome(oldSlots[i]), this->hashOf(oldSlots[i]));
+      }
+    }
+
+    if (oldSlots && ownedOldSlots) free(oldSlots);
+  }
+};
+
+#endif  // FLAT_TABLE_H_
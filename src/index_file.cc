@@ -0,0 +1,124 @@
+#include "index_file.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+namespace index_file {
+
+static const size_t SlotsAlignment = 64;
+
+static bool
+writeAll(FILE* f, const void* data, size_t len)
+{
+  return len == 0 || fwrite(data, 1, len, f) == len;
+}
+
+bool
+write(const char* path, uint32_t hashFunction, uint64_t tokenizer, bool ids,
+    const char* pool, size_t poolLength, const char* arena, size_t arenaLength,
+    const void* slots, size_t slotSize, size_t capacity, size_t count,
+    const uint16_t* pilots, size_t buckets, uint64_t seed,
+    const char** syscall)
+{
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, Magic, sizeof(Magic));
+  header.version = Version;
+  header.byteOrderMark = ByteOrderMark;
+  header.hashFunction = hashFunction;
+  header.slotSize = slotSize;
+  header.tokenizer = tokenizer;
+  header.ids = ids ? 1 : 0;
+  header.poolOffset = sizeof(Header);
+  header.poolLength = poolLength + arenaLength;
+  header.slotsOffset = (header.poolOffset + header.poolLength + SlotsAlignment - 1) / SlotsAlignment * SlotsAlignment;
+  header.capacity = capacity;
+  header.count = count;
+  header.buckets = pilots ? buckets : 0;
+  header.seed = seed;
+
+  const char padding[SlotsAlignment] = { 0 };
+  const size_t paddingLength = header.slotsOffset - header.poolOffset - header.poolLength;
+
+  // Write a temporary file and rename it over `path`, so whoever has the old
+  // file mapped (maybe the set we're writing) keeps reading the old file.
+  const std::string tmpPath = std::string(path) + ".tmp";
+  FILE* f = fopen(tmpPath.c_str(), "wb");
+  if (f == NULL) {
+    *syscall = "open";
+    return false;
+  }
+
+  if (!writeAll(f, &header, sizeof(header))
+      || !writeAll(f, pool, poolLength)
+      || !writeAll(f, arena, arenaLength)
+      || !writeAll(f, padding, paddingLength)
+      || !writeAll(f, slots, slotSize * capacity)
+      || !writeAll(f, pilots, header.buckets * sizeof(uint16_t))) {
+    *syscall = "write";
+    const int err = errno;
+    fclose(f);
+    unlink(tmpPath.c_str());
+    errno = err;
+    return false;
+  }
+
+  if (fclose(f) != 0) {
+    *syscall = "close";
+    const int err = errno;
+    unlink(tmpPath.c_str());
+    errno = err;
+    return false;
+  }
+
+  if (rename(tmpPath.c_str(), path) != 0) {
+    *syscall = "rename";
+    const int err = errno;
+    unlink(tmpPath.c_str());
+    errno = err;
+    return false;
+  }
+
+  return true;
+}
+
+const char*
+parse(const char* data, size_t length, uint32_t hashFunction,
+    uint64_t tokenizer, bool ids, size_t slotSize, Contents* contents)
+{
+  Header header;
+  if (length < sizeof(header)) return "index file is truncated";
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.magic, Magic, sizeof(Magic)) != 0) return "not an index file";
+  if (header.version != Version) return "unsupported index file version";
+  if (header.byteOrderMark != ByteOrderMark) return "index file was written on a machine with a different byte order";
+  if (header.hashFunction != hashFunction) return "index file was written with a different hash function";
+  if (header.slotSize != slotSize) return "index file was written with a different slot layout";
+  if (header.tokenizer != tokenizer) return "index file was written with different tokenizer options";
+  if (header.ids != (ids ? 1u : 0u)) return ids ? "index file has no ids" : "index file has ids; load it with ids: true";
+
+  if (header.buckets == 0 && (header.capacity & (header.capacity - 1))) return "index file is corrupt";
+  if (header.count > header.capacity) return "index file is corrupt";
+  if (header.poolOffset > length || header.poolLength > length - header.poolOffset) return "index file is truncated";
+  if (header.slotsOffset % SlotsAlignment != 0) return "index file is corrupt";
+  if (header.slotsOffset > length || header.capacity > (length - header.slotsOffset) / slotSize) return "index file is truncated";
+  const size_t pilotsOffset = header.slotsOffset + header.capacity * slotSize;
+  if (header.buckets > (length - pilotsOffset) / sizeof(uint16_t)) return "index file is truncated";
+
+  contents->pool = data + header.poolOffset;
+  contents->poolLength = header.poolLength;
+  contents->slots = data + header.slotsOffset;
+  contents->capacity = header.capacity;
+  contents->count = header.count;
+  contents->pilots = header.buckets ? reinterpret_cast<const uint16_t*>(data + pilotsOffset) : NULL;
+  contents->buckets = header.buckets;
+  contents->seed = header.seed;
+  return NULL;
+}
+
+}  // namespace index_file
@@ -0,0 +1,70 @@
+#ifndef INDEX_FILE_H_
+#define INDEX_FILE_H_
+
+#include <cstddef>
+#include <stdint.h>
+
+// A prebuilt set on disk, laid out so it can be mmap()ed and used as-is:
+//
+//     IndexFileHeader
+//     pool bytes (what PooledStrings point into)
+//     padding to a 64-byte boundary
+//     hash table slots
+//     with a perfect hash (FlatTable::makePerfect()), 2-byte pilots
+//
+// Everything is in native byte order and sizes; the header says which, and
+// we refuse files that don't match the running build. We don't look inside
+// the slots: an index file is as trusted as the code that reads it.
+namespace index_file {
+
+static const char Magic[8] = { 'U', 'B', 'S', 'I', 'N', 'D', 'E', 'X' };
+static const uint32_t Version = 5;
+static const uint32_t ByteOrderMark = 0x01020304;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrderMark;
+  uint32_t hashFunction; // which function hashed the slots
+  uint32_t slotSize;
+  uint64_t tokenizer; // Tokenizer::fingerprint() of the one that built the keys
+  uint32_t ids; // 1 if every key in the pool is followed by a tab and an id
+  uint32_t reserved;
+  uint64_t poolOffset;
+  uint64_t poolLength;
+  uint64_t slotsOffset;
+  uint64_t capacity; // number of slots; a power of two, unless buckets > 0
+  uint64_t count; // number of keys
+  uint64_t buckets; // number of pilots, right after the slots; 0 without a perfect hash
+  uint64_t seed; // the perfect hash's
+};
+
+// What the sections of a loaded file look like.
+struct Contents {
+  const char* pool;
+  size_t poolLength;
+  const void* slots;
+  size_t capacity;
+  size_t count;
+  const uint16_t* pilots; // NULL without a perfect hash
+  size_t buckets;
+  uint64_t seed;
+};
+
+// Writes the file, with arena[0,arenaLength) right after the pool (so slots
+// can point past the pool, into the arena). pilots may be NULL. Returns false
+// and sets errno on failure; `syscall` names the call that failed.
+bool write(const char* path, uint32_t hashFunction, uint64_t tokenizer, bool ids,
+    const char* pool, size_t poolLength, const char* arena, size_t arenaLength,
+    const void* slots, size_t slotSize, size_t capacity, size_t count,
+    const uint16_t* pilots, size_t buckets, uint64_t seed,
+    const char** syscall);
+
+// Finds the sections of a file that's already in memory. Returns an error
+// message, or NULL on success.
+const char* parse(const char* data, size_t length, uint32_t hashFunction,
+    uint64_t tokenizer, bool ids, size_t slotSize, Contents* contents);
+
+}  // namespace index_file
+
+#endif  // INDEX_FILE_H_
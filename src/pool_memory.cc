@@ -0,0 +1,129 @@
+#include "pool_memory.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PoolMemory::PoolMemory(): start(NULL), length(0), kind(Empty) {}
+
+PoolMemory::~PoolMemory()
+{
+  this->release();
+}
+
+void
+PoolMemory::copy(const char* s, size_t len)
+{
+  this->release();
+
+  char* mem = new char[len];
+  memcpy(mem, s, len);
+
+  this->start = mem;
+  this->length = len;
+  this->kind = Copied;
+}
+
+void
+PoolMemory::borrow(const char* s, size_t len)
+{
+  this->release();
+
+  this->start = s;
+  this->length = len;
+  this->kind = Borrowed;
+}
+
+void
+PoolMemory::take(char* s, size_t len)
+{
+  this->release();
+
+  this->start = s;
+  this->length = len;
+  this->kind = Copied;
+}
+
+bool
+PoolMemory::map(const char* path, const char** syscall)
+{
+  this->release();
+
+  const int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    *syscall = "open";
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    *syscall = "fstat";
+    const int err = errno;
+    close(fd);
+    errno = err;
+    return false;
+  }
+
+  if (st.st_size == 0) {
+    // mmap() refuses zero-length mappings, and there's nothing to map anyway.
+    close(fd);
+    this->kind = Copied;
+    this->start = new char[0];
+    return true;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  const int err = errno;
+  close(fd); // the mapping keeps the file open
+  if (addr == MAP_FAILED) {
+    *syscall = "mmap";
+    errno = err;
+    return false;
+  }
+
+  // We're about to read the whole thing, start to finish.
+  madvise(addr, st.st_size, MADV_WILLNEED);
+
+  this->start = static_cast<const char*>(addr);
+  this->length = st.st_size;
+  this->kind = Mapped;
+  return true;
+}
+
+void
+PoolMemory::adopt(PoolMemory& other)
+{
+  this->release();
+
+  this->start = other.start;
+  this->length = other.length;
+  this->kind = other.kind;
+
+  other.start = NULL;
+  other.length = 0;
+  other.kind = Empty;
+}
+
+void
+PoolMemory::release()
+{
+  switch (this->kind) {
+    case Copied:
+      delete[] this->start;
+      break;
+    case Mapped:
+      munmap(const_cast<char*>(this->start), this->length);
+      break;
+    case Borrowed:
+    case Empty:
+      break;
+  }
+
+  this->start = NULL;
+  this->length = 0;
+  this->kind = Empty;
+}
@@ -0,0 +1,48 @@
+#ifndef POOL_MEMORY_H_
+#define POOL_MEMORY_H_
+
+#include <cstddef>
+
+// The bytes every PooledString points into, plus how to let go of them.
+//
+// Copying the input is the safe default: the caller can do whatever it wants
+// with its Buffer afterwards. But a copy doubles peak memory while the Buffer
+// is still alive, so we can also borrow the caller's bytes (the caller must
+// keep them alive and unchanged) or map a file read-only, in which case the
+// kernel pages it in and out for us and nothing ever lands on the heap.
+class PoolMemory {
+public:
+  PoolMemory();
+  ~PoolMemory();
+
+  const char* data() const { return this->start; }
+  size_t size() const { return this->length; }
+  bool isMapped() const { return this->kind == Mapped; }
+  bool isBorrowed() const { return this->kind == Borrowed; }
+
+  // Each of these releases whatever we held before.
+  void copy(const char* s, size_t len);
+  void borrow(const char* s, size_t len);
+  // Takes ownership of s, which must come from new[].
+  void take(char* s, size_t len);
+  // Returns false and sets errno on failure; `syscall` names the call that
+  // failed.
+  bool map(const char* path, const char** syscall);
+
+  // Takes ownership of whatever `other` holds, leaving it empty.
+  void adopt(PoolMemory& other);
+
+  void release();
+
+private:
+  enum Kind { Empty, Copied, Borrowed, Mapped };
+
+  const char* start;
+  size_t length;
+  Kind kind;
+
+  PoolMemory(const PoolMemory&);
+  PoolMemory& operator=(const PoolMemory&);
+};
+
+#endif  // POOL_MEMORY_H_
@@ -0,0 +1,32 @@
+#ifndef POOLED_STRING_H_
+#define POOLED_STRING_H_
+
+#include <cstddef>
+#include <cstring>
+
+// It turns out std::string's memory allocations are the bottleneck. Nix them
+// all by using a copy of the original input as the actual data structure.
+//
+// In other words: SimpleString holds a pointer that must be managed by its
+// caller.
+struct PooledString {
+  const char* start; // Points to UnorderedBufferSet.mem
+  size_t length;
+
+  bool operator==(const PooledString& rhs) const {
+    return rhs.length == this->length
+      && memcmp(this->start, rhs.start, this->length) == 0;
+  }
+
+  PooledString& operator=(const PooledString& rhs) {
+    this->start = rhs.start;
+    this->length = rhs.length;
+    return *this;
+  }
+
+  explicit PooledString(): start(NULL), length(-1) {}
+  explicit PooledString(const PooledString& rhs): start(rhs.start), length(rhs.length) {}
+  explicit PooledString(const char* s, size_t l): start(s), length(l) {}
+};
+
+#endif  // POOLED_STRING_H_
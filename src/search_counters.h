@@ -0,0 +1,28 @@
+#ifndef SEARCH_COUNTERS_H_
+#define SEARCH_COUNTERS_H_
+
+#include <stdint.h>
+
+// What a search did. A search counts into one of these on its own stack, as
+// it goes, and adds it to the set's totals once, at the end (see
+// BufferSet::Options::counters), so counting costs a few adds per lookup
+// and threads never contend.
+struct SearchCounters {
+  uint64_t searches = 0;    // calls: contains(), findAllMatches(), ...
+  uint64_t lookups = 0;     // keys and n-grams (or, with the automaton, words) looked up
+  uint64_t hits = 0;        // keys found: contains() == true, or matches
+  uint64_t filtered = 0;    // lookups the Bloom filter turned away
+  uint64_t probes = 0;      // hash table slots looked at
+  uint64_t bytesHashed = 0; // bytes of keys and words hashed
+
+  void add(const SearchCounters& rhs) {
+    this->searches += rhs.searches;
+    this->lookups += rhs.lookups;
+    this->hits += rhs.hits;
+    this->filtered += rhs.filtered;
+    this->probes += rhs.probes;
+    this->bytesHashed += rhs.bytesHashed;
+  }
+};
+
+#endif  // SEARCH_COUNTERS_H_
@@ -0,0 +1,32 @@
+#ifndef SMALL_BUFFER_H_
+#define SMALL_BUFFER_H_
+
+#include <cstddef>
+#include <vector>
+
+// n Ts of scratch space, on the stack unless n is more than Inline. A search
+// needs a few per word of its longest n-gram, and shouldn't malloc for them
+// on every call.
+template<typename T, size_t Inline>
+class SmallBuffer {
+public:
+  explicit SmallBuffer(size_t n): data(this->inlineData) {
+    if (n > Inline) {
+      this->heap.resize(n);
+      this->data = &this->heap[0];
+    }
+  }
+
+  T& operator[](size_t i) { return this->data[i]; }
+  const T& operator[](size_t i) const { return this->data[i]; }
+
+private:
+  T inlineData[Inline];
+  std::vector<T> heap;
+  T* data;
+
+  SmallBuffer(const SmallBuffer&);
+  SmallBuffer& operator=(const SmallBuffer&);
+};
+
+#endif  // SMALL_BUFFER_H_
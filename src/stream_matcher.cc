@@ -0,0 +1,75 @@
+#include "stream_matcher.h"
+
+void
+StreamMatcher::write(const BufferSet& set, const char* s, size_t len,
+    std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids)
+{
+  const Tokenizer& tokenizer = set.options().tokenizer;
+  const Delimiters& delimiters = tokenizer.delimiterSet();
+  this->discard();
+
+  // Without a delimiter in the chunk, its first byte continues a word we
+  // can't search yet. (Everything before it we've searched already.)
+  size_t cut = len;
+  while (cut > 0 && !delimiters.contains(s[cut - 1])) cut--;
+
+  const size_t oldSize = this->pending.size();
+  this->pending.insert(this->pending.end(), s, s + len);
+  if (cut == 0) return;
+
+  cut = oldSize + cut - 1; // the delimiter
+  this->search(set, cut, matches, offsets, ids);
+
+  // Keep the words an n-gram ending in the next chunk could start in. But
+  // not until the next call: the matches point into pending.
+  const char* data = this->pending.data();
+  this->discarded = this->maxNgramSize > 1
+    ? tokenizer.lastWordsStart(data, data + cut, this->maxNgramSize - 1) - data
+    : cut + 1;
+  this->hasSearched = this->discarded <= cut;
+  this->searched = this->hasSearched ? cut - this->discarded : 0;
+}
+
+void
+StreamMatcher::end(const BufferSet& set,
+    std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids)
+{
+  this->discard();
+  this->search(set, this->pending.size(), matches, offsets, ids);
+
+  // Start over, once the caller is done with the matches
+  this->discarded = this->pending.size();
+  this->restart = true;
+  this->hasSearched = false;
+  this->searched = 0;
+}
+
+void
+StreamMatcher::discard()
+{
+  this->pending.erase(this->pending.begin(), this->pending.begin() + this->discarded);
+  this->pendingOffset = this->restart ? 0 : this->pendingOffset + this->discarded;
+  this->discarded = 0;
+  this->restart = false;
+}
+
+// Finds the matches in pending[0,end) that end after `searched` (which is
+// relative to pending, like `end`).
+void
+StreamMatcher::search(const BufferSet& set, size_t end,
+    std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids)
+{
+  const char* data = this->pending.data();
+  std::vector<PooledString> found;
+  std::vector<uint32_t> foundIds;
+  set.findMatches(data, end, this->maxNgramSize, &found, ids ? &foundIds : NULL);
+
+  for (size_t i = 0; i < found.size(); i++) {
+    const size_t start = found[i].start - data;
+    if (this->hasSearched && start + found[i].length <= this->searched) continue;
+
+    matches->push_back(found[i]);
+    offsets->push_back(this->pendingOffset + start);
+    if (ids) ids->push_back(foundIds[i]);
+  }
+}
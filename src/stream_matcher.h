@@ -0,0 +1,57 @@
+#ifndef STREAM_MATCHER_H_
+#define STREAM_MATCHER_H_
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "buffer_set.h"
+#include "pooled_string.h"
+
+// BufferSet::findAllMatches() over a document that arrives in chunks.
+//
+// A match can't end at a word we haven't seen the end of, so each write()
+// searches up to the chunk's last delimiter. It keeps the text from the start
+// of the last maxNgramSize - 1 words it searched, so the next write() can
+// find n-grams that start in them, and skips the matches it already found.
+// So we hold on to about a chunk plus an n-gram, however long the document.
+//
+// Results are the same as findAllMatches() over the whole document, in the
+// same order. Pass a set to each call: it needn't be the same one, so the
+// caller can rebuild or change its set between chunks.
+class StreamMatcher {
+public:
+  explicit StreamMatcher(size_t maxNgramSize): maxNgramSize(maxNgramSize) {}
+
+  // Reads the next chunk. Appends the matches it completes to `matches`,
+  // their offsets from the start of the document to `offsets`, and, if it
+  // isn't NULL, their ids to `ids`. Matches point into our buffer, and are
+  // valid until the next call.
+  void write(const BufferSet& set, const char* s, size_t len,
+      std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids);
+
+  // Says the document is over: appends the matches in its last words, then
+  // starts over, ready for another document.
+  void end(const BufferSet& set,
+      std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids);
+
+  // How many bytes of the document we're holding on to.
+  size_t buffered() const { return this->pending.size() - this->discarded; }
+
+private:
+  size_t maxNgramSize;
+  std::vector<char> pending; // the document from the start of the words we kept
+  uint64_t pendingOffset = 0; // where pending[0] is in the document
+  size_t discarded = 0; // pending[0,discarded) goes at the next call
+  bool restart = false; // if true, the next call starts a new document
+  // If true, we've searched up to the delimiter at pending[searched], so
+  // matches that end before it are old news.
+  bool hasSearched = false;
+  size_t searched = 0;
+
+  void discard();
+  void search(const BufferSet& set, size_t end,
+      std::vector<PooledString>* matches, std::vector<uint64_t>* offsets, std::vector<uint32_t>* ids);
+};
+
+#endif  // STREAM_MATCHER_H_
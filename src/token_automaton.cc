@@ -0,0 +1,163 @@
+#include "token_automaton.h"
+
+#include <cstring>
+
+#include "farmhash.h"
+
+const uint32_t TokenAutomaton::Root;
+const uint32_t TokenAutomaton::NoState;
+const uint64_t TokenAutomaton::NoToken;
+
+TokenAutomaton::TokenAutomaton(const char* base, size_t length, const Tokenizer& tokenizer, bool ids)
+  : base(base), tokenizer(tokenizer), vocabulary(TokenTraits(tokenizer.hashFamily(), tokenizer.joinerByte(), ids)),
+    edges(16), hasIds(ids), nEdges(0), maxDepth(0)
+{
+  this->vocabulary.setBase(base, length);
+
+  State root = { Root, NoState, 0, 0 };
+  this->states.push_back(root);
+  Origin rootOrigin = { NoToken, Root };
+  this->origins.push_back(rootOrigin);
+}
+
+size_t
+TokenAutomaton::edgeHash(uint32_t from, uint64_t token)
+{
+  return util::Hash128to64(util::Uint128(token, from));
+}
+
+uint64_t
+TokenAutomaton::tokenId(const char* s, size_t len, uint64_t* probes) const
+{
+  const Tokenizer& tokenizer = this->tokenizer;
+  const FlatTable<TokenTraits>::Slot* slot = this->vocabulary.find(tokenizer.wordHash(s, len), [&tokenizer, s, len](const char* key, size_t keyLength) {
+    return keyLength == len && tokenizer.wordEquals(s, len, key);
+  }, probes);
+  return slot ? slot->offset() : NoToken;
+}
+
+uint32_t
+TokenAutomaton::next(uint32_t from, uint64_t token) const
+{
+  const size_t mask = this->edges.size() - 1;
+  for (size_t i = edgeHash(from, token) & mask; ; i = (i + 1) & mask) {
+    const Edge& edge = this->edges[i];
+    if (edge.to == Root) return NoState;
+    if (edge.from == from && edge.token == token) return edge.to;
+  }
+}
+
+void
+TokenAutomaton::addEdge(uint32_t from, uint64_t token, uint32_t to)
+{
+  if ((this->nEdges + 1) * 2 > this->edges.size()) this->growEdges();
+
+  const size_t mask = this->edges.size() - 1;
+  size_t i = edgeHash(from, token) & mask;
+  while (this->edges[i].to != Root) i = (i + 1) & mask;
+
+  Edge edge = { token, from, to };
+  this->edges[i] = edge;
+  this->nEdges++;
+}
+
+void
+TokenAutomaton::growEdges()
+{
+  std::vector<Edge> old(this->edges.size() * 2);
+  old.swap(this->edges);
+  this->nEdges = 0;
+
+  for (auto i = old.begin(); i < old.end(); i++) {
+    if (i->to != Root) this->addEdge(i->from, i->token, i->to);
+  }
+}
+
+void
+TokenAutomaton::add(const char* s, size_t len, uint32_t id)
+{
+  const char* end = s + len;
+  uint32_t state = Root;
+  uint32_t depth = 0;
+  const char joiner = this->tokenizer.joinerByte();
+
+  while (true) {
+    const char* p = static_cast<const char*>(memchr(s, joiner, end - s));
+    if (p == NULL) p = end;
+
+    const uint64_t hash = token_hash::token(this->tokenizer.hashFamily(), s, p - s);
+    this->vocabulary.insert(s - this->base, p - s, hash);
+    const uint64_t token = this->vocabulary.find(s, p - s, hash)->offset();
+
+    depth++;
+    uint32_t child = this->next(state, token);
+    if (child == NoState) {
+      child = this->states.size();
+      State st = { Root, NoState, depth, 0 };
+      this->states.push_back(st);
+      Origin origin = { token, state };
+      this->origins.push_back(origin);
+      this->addEdge(state, token, child);
+    }
+    state = child;
+
+    if (p == end) break;
+    s = p + 1;
+  }
+
+  this->states[state].isKey = 1;
+  if (this->hasIds) {
+    this->keyIds.resize(this->states.size());
+    this->keyIds[state] = id;
+  }
+  if (depth > this->maxDepth) this->maxDepth = depth;
+}
+
+void
+TokenAutomaton::compile()
+{
+  // Visit states in breadth-first order, so every state's fail link is
+  // computed after those of all shallower states. Counting sort by depth.
+  std::vector<uint32_t> byDepth(this->states.size());
+  std::vector<size_t> depthStart(this->maxDepth + 2, 0);
+  for (auto i = this->states.begin(); i < this->states.end(); i++) {
+    depthStart[i->depth + 1]++;
+  }
+  for (size_t d = 1; d < depthStart.size(); d++) depthStart[d] += depthStart[d - 1];
+  for (uint32_t i = 0; i < this->states.size(); i++) {
+    byDepth[depthStart[this->states[i].depth]++] = i;
+  }
+
+  for (auto i = byDepth.begin(); i < byDepth.end(); i++) {
+    const uint32_t v = *i;
+    if (v == Root) continue;
+
+    const Origin& origin = this->origins[v];
+    State& state = this->states[v];
+
+    if (origin.parent == Root) {
+      state.fail = Root;
+    } else {
+      uint32_t f = this->states[origin.parent].fail;
+      uint32_t g;
+      while ((g = this->next(f, origin.token)) == NoState && f != Root) {
+        f = this->states[f].fail;
+      }
+      state.fail = g == NoState ? Root : g;
+    }
+
+    const State& fail = this->states[state.fail];
+    state.output = fail.isKey ? state.fail : fail.output;
+  }
+
+  std::vector<Origin>().swap(this->origins);
+}
+
+size_t
+TokenAutomaton::memoryUsage() const
+{
+  return this->vocabulary.memoryUsage()
+    + this->states.capacity() * sizeof(State)
+    + this->edges.capacity() * sizeof(Edge)
+    + this->keyIds.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,160 @@
+#ifndef TOKEN_AUTOMATON_H_
+#define TOKEN_AUTOMATON_H_
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+#include "flat_table.h"
+#include "pooled_string.h"
+#include "search_counters.h"
+#include "small_buffer.h"
+#include "token_hash.h"
+#include "tokenizer.h"
+
+// An Aho-Corasick automaton over words rather than bytes.
+//
+// The n-gram window probes the hash table once per (word, n-gram length),
+// even when nothing matches. This walks the document once: one vocabulary
+// probe per word, then a state transition, and it only ever reports real
+// matches. It doesn't care how many words the longest key has.
+//
+// Usage: add() every key, compile(), then forEachMatch() as often as you
+// like. Keys must live in the pool passed to the constructor, and that pool
+// and the Tokenizer must outlive the automaton. With ids, keys in the pool end
+// at a tab (see BufferSet), and the automaton remembers each key's id.
+class TokenAutomaton {
+public:
+  TokenAutomaton(const char* base, size_t length, const Tokenizer& tokenizer, bool ids = false);
+
+  // Adds a key, in the Tokenizer's canonical form. Call add() only with
+  // distinct keys, and only before compile().
+  void add(const char* s, size_t len, uint32_t id = 0);
+
+  // Computes failure links. After this, the automaton is read-only.
+  void compile();
+
+  // Calls f(start, length, key) for every key that appears in s[0,len) and
+  // has at most maxNgramSize words, in the same order the n-gram window would
+  // find them: by end position, longest first. `key` identifies the key (it's
+  // the state that accepts it); keyId() turns it into the key's id. If
+  // counters isn't NULL, counts into it.
+  template<typename F> void forEachMatch(const char* s, size_t len, size_t maxNgramSize, F f,
+      SearchCounters* counters = NULL) const {
+    if (this->maxDepth == 0) return;
+
+    // The starts of the last maxDepth words, so we can turn a key's depth
+    // into an offset in s.
+    SmallBuffer<const char*, 16> wordStarts(this->maxDepth);
+    size_t nWords = 0;
+
+    Tokenizer::Iterator words(this->tokenizer, s, s + len);
+    const char* word;
+    size_t wordLength;
+    uint32_t state = Root;
+
+    while (words.next(&word, &wordLength)) {
+      wordStarts[nWords % this->maxDepth] = word;
+      nWords++;
+
+      if (counters) {
+        counters->lookups++;
+        counters->bytesHashed += wordLength;
+      }
+      const uint64_t token = this->tokenId(word, wordLength, counters ? &counters->probes : NULL);
+      if (token == NoToken) {
+        // No key contains this word, so no partial match survives it.
+        state = Root;
+        continue;
+      }
+
+      uint32_t g;
+      while ((g = this->next(state, token)) == NoState && state != Root) {
+        state = this->states[state].fail;
+      }
+      state = g == NoState ? Root : g;
+
+      const char* wordEnd = word + wordLength;
+      const State& st = this->states[state];
+      for (uint32_t o = st.isKey ? state : st.output; o != NoState; o = this->states[o].output) {
+        const uint32_t depth = this->states[o].depth;
+        if (depth > maxNgramSize) continue;
+
+        const char* start = wordStarts[(nWords - depth) % this->maxDepth];
+        f(start, static_cast<size_t>(wordEnd - start), o);
+        if (counters) counters->hits++;
+      }
+    }
+  }
+
+  // With ids, the id of the key forEachMatch() called `key`.
+  uint32_t keyId(uint32_t key) const { return this->keyIds[key]; }
+
+  size_t memoryUsage() const;
+
+private:
+  // Words are in keys, so they end at a joiner or the end of a line.
+  struct TokenTraits {
+    token_hash::Family family;
+    char joiner;
+    char terminator; // '\t' with ids, else '\n'
+
+    explicit TokenTraits(token_hash::Family family = token_hash::FarmHash, char joiner = ' ', bool ids = false)
+      : family(family), joiner(joiner), terminator(ids ? '\t' : '\n') {}
+
+    uint64_t hash(const char* s, size_t len) const {
+      return token_hash::token(this->family, s, len);
+    }
+
+    bool isTerminator(char c) const { return c == this->joiner || c == '\n' || c == this->terminator; }
+
+    const char* keyEnd(const char* key, const char* end) const {
+      while (key < end && !this->isTerminator(*key)) key++;
+      return key;
+    }
+  };
+
+  // A trie edge: from a state, on a word, to a state. A word is identified by
+  // its vocabulary slot's offset, which is unique per distinct word.
+  struct Edge {
+    uint64_t token;
+    uint32_t from;
+    uint32_t to; // 0 (the root) means "empty"
+  };
+
+  struct State {
+    uint32_t fail;      // longest proper suffix that's also a trie state
+    uint32_t output;    // nearest key state along the fail chain, or NoState
+    uint32_t depth;     // number of words
+    uint32_t isKey;
+  };
+
+  static const uint32_t Root = 0;
+  static const uint32_t NoState = 0xffffffff;
+  static const uint64_t NoToken = ~static_cast<uint64_t>(0);
+
+  // How each state was reached. Only needed until compile().
+  struct Origin {
+    uint64_t token;
+    uint32_t parent;
+  };
+
+  const char* base;
+  const Tokenizer& tokenizer;
+  FlatTable<TokenTraits> vocabulary;
+  std::vector<State> states;
+  std::vector<Origin> origins;
+  std::vector<Edge> edges; // open-addressed hash table of Edges
+  std::vector<uint32_t> keyIds; // by state, with ids; else empty
+  bool hasIds;
+  size_t nEdges;
+  size_t maxDepth;
+
+  uint64_t tokenId(const char* s, size_t len, uint64_t* probes = NULL) const;
+  uint32_t next(uint32_t from, uint64_t token) const;
+  void addEdge(uint32_t from, uint64_t token, uint32_t to);
+  void growEdges();
+  static size_t edgeHash(uint32_t from, uint64_t token);
+};
+
+#endif  // TOKEN_AUTOMATON_H_
@@ -0,0 +1,102 @@
+#ifndef TOKEN_HASH_H_
+#define TOKEN_HASH_H_
+
+#include <cstring>
+#include <stdint.h>
+
+#include "crc32c_hash.h"
+#include "farmhash.h"
+
+// A hash over space-separated tokens, built so that hash("a b c") can be
+// computed from hash("a b") and hash("c") without looking at the bytes again.
+//
+// findAllMatches() needs the hash of every n-gram that ends at every token.
+// Hashing each n-gram's bytes from scratch costs O(ngram length) per probe;
+// with this, each token's bytes are hashed exactly once and each n-gram costs
+// one extend().
+//
+// The table must use this same hash at build time, or nothing would match.
+//
+// Each token is hashed with one of a few Families. Their values identify the
+// hash in index files, so never reuse one.
+namespace token_hash {
+
+enum Family {
+  FarmHash = 1, // util::Fingerprint64
+  Fast = 2      // short_token() up to 16 bytes, crc32c_hash::hash beyond
+};
+
+// Multiplies, then folds the 128-bit product's halves together.
+inline uint64_t
+mum(uint64_t x, uint64_t y) {
+#if defined(__SIZEOF_INT128__)
+  const unsigned __int128 product = static_cast<unsigned __int128>(x) * y;
+  return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+  const uint64_t xLo = x & 0xffffffff, xHi = x >> 32, yLo = y & 0xffffffff, yHi = y >> 32;
+  const uint64_t lolo = xLo * yLo, lohi = xLo * yHi, hilo = xHi * yLo, hihi = xHi * yHi;
+  const uint64_t middle = (lolo >> 32) + (lohi & 0xffffffff) + (hilo & 0xffffffff);
+  const uint64_t lo = (lolo & 0xffffffff) | (middle << 32);
+  const uint64_t hi = hihi + (lohi >> 32) + (hilo >> 32) + (middle >> 32);
+  return lo ^ hi;
+#endif
+}
+
+// Most words are 3-20 bytes, where Fingerprint64's setup and finalization
+// cost more than the bytes do. This is one multiply of two (possibly
+// overlapping) loads, inlined. len must be at most 16.
+inline uint64_t
+short_token(const char* s, size_t len) {
+  uint64_t x, y;
+  if (len >= 8) {
+    memcpy(&x, s, 8);
+    memcpy(&y, s + len - 8, 8);
+  } else if (len >= 4) {
+    uint32_t a, b;
+    memcpy(&a, s, 4);
+    memcpy(&b, s + len - 4, 4);
+    x = a;
+    y = b;
+  } else if (len > 0) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(s);
+    x = (static_cast<uint64_t>(u[0]) << 16) | (static_cast<uint64_t>(u[len / 2]) << 8) | u[len - 1];
+    y = 0;
+  } else {
+    x = y = 0;
+  }
+
+  // Spread len over every bit of y, so "1000" and "10000" can't cancel out
+  return mum(x ^ 0xa0761d6478bd642fULL, y ^ (0xe7037ed1a0b428dbULL + len * 0x8ebc6af09c88c6e3ULL));
+}
+
+inline uint64_t
+token(Family family, const char* s, size_t len) {
+  if (family == FarmHash) return util::Fingerprint64(s, len);
+  return len <= 16 ? short_token(s, len) : crc32c_hash::hash(s, len);
+}
+
+// Returns the hash of (tokens of `prefix`) + " " + (token `next`).
+inline uint64_t
+extend(uint64_t prefix, uint64_t next) {
+  return util::Hash128to64(util::Uint128(prefix, next));
+}
+
+// Returns the hash of s[0,len), split on `separator`.
+inline uint64_t
+hash(Family family, const char* s, size_t len, char separator = ' ') {
+  const char* end = s + len;
+  const char* p = static_cast<const char*>(memchr(s, separator, len));
+  if (p == NULL) return token(family, s, len);
+
+  uint64_t ret = token(family, s, p - s);
+  while (true) {
+    s = p + 1;
+    p = static_cast<const char*>(memchr(s, separator, end - s));
+    if (p == NULL) return extend(ret, token(family, s, end - s));
+    ret = extend(ret, token(family, s, p - s));
+  }
+}
+
+}  // namespace token_hash
+
+#endif  // TOKEN_HASH_H_
@@ -0,0 +1,230 @@
+#ifndef TOKENIZER_H_
+#define TOKENIZER_H_
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#include "case_fold.h"
+#include "delimiter_scanner.h"
+#include "farmhash.h"
+#include "token_hash.h"
+
+// Splits text into the words that keys and documents are made of.
+//
+// By default a word is whatever lies between two single spaces, so "foo  bar"
+// is three words, the middle one empty, and "foo," is not "foo". That's fast
+// and predictable, but real documents have tabs, newlines, runs of spaces and
+// punctuation. Rather than make callers normalize every document in
+// JavaScript, a Tokenizer can:
+//
+// * split on any of a set of delimiter bytes;
+// * collapse runs of delimiters (which also ignores leading and trailing
+//   ones), by dropping empty words;
+// * strip punctuation bytes from the start and end of each word;
+// * fold case (see case_fold.h), without changing any word's length.
+//
+// Dictionary lines go through the same Tokenizer. We store each key in
+// canonical form: its words, joined by the first delimiter byte other than
+// '\n' (the "joiner"). Since the joiner is a delimiter, it never appears
+// inside a word.
+//
+// A default Tokenizer "isPlain()": canonical form is the text itself, so
+// callers can compare bytes instead of words. Otherwise, compare a document's
+// words to a key's with wordHash() and wordEquals(): they fold on the fly, so
+// a document never needs a folded copy.
+class Tokenizer {
+public:
+  Tokenizer() : delimiters(" "), joiner(' '), collapse(false), hasPunctuation(false), foldMode(case_fold::None),
+    family(token_hash::FarmHash) {}
+
+  // `delimiters` must be non-empty.
+  Tokenizer(const char* delimiters, size_t nDelimiters, bool collapse, const char* punctuation, size_t nPunctuation,
+      case_fold::Mode foldMode = case_fold::None)
+    : joiner(delimiters[0]), collapse(collapse), hasPunctuation(nPunctuation > 0), foldMode(foldMode),
+      family(token_hash::FarmHash)
+  {
+    for (size_t i = 0; i < nDelimiters; i++) this->delimiters.add(delimiters[i]);
+    // Dictionary lines end in '\n', so don't join words with it
+    for (size_t i = nDelimiters; i > 0; i--) {
+      if (delimiters[i - 1] != '\n') this->joiner = delimiters[i - 1];
+    }
+    for (size_t i = 0; i < nPunctuation; i++) this->punctuation.add(punctuation[i]);
+  }
+
+  const Delimiters& delimiterSet() const { return this->delimiters; }
+  char joinerByte() const { return this->joiner; }
+
+  // Which hash words go through. (It isn't part of fingerprint(): index files
+  // record it separately.)
+  token_hash::Family hashFamily() const { return this->family; }
+  void setHashFamily(token_hash::Family family) { this->family = family; }
+
+  bool isPlain() const {
+    return !this->collapse && !this->hasPunctuation && this->foldMode == case_fold::None
+      && this->delimiters.contains(' ') && this->delimiters.size() == 1;
+  }
+
+  // token_hash::token() of the word's canonical (folded) form.
+  uint64_t wordHash(const char* word, size_t len) const {
+    if (this->foldMode == case_fold::None) return token_hash::token(this->family, word, len);
+
+    char buf[256];
+    char* folded = len <= sizeof(buf) ? buf : new char[len];
+    case_fold::fold(this->foldMode, word, len, folded);
+    const uint64_t ret = token_hash::token(this->family, folded, len);
+    if (folded != buf) delete[] folded;
+    return ret;
+  }
+
+  // True if the word's canonical form is key[0,len).
+  bool wordEquals(const char* word, size_t len, const char* key) const {
+    return case_fold::folded_equals(this->foldMode, word, key, len);
+  }
+
+  // Identifies what this Tokenizer does, so an index file built with one
+  // Tokenizer isn't loaded with another.
+  uint64_t fingerprint() const {
+    unsigned char config[2 * 256 + 2];
+    for (int i = 0; i < 256; i++) {
+      config[i] = this->delimiters.contains(static_cast<char>(i)) ? (static_cast<char>(i) == this->joiner ? 2 : 1) : 0;
+      config[256 + i] = this->punctuation.contains(static_cast<char>(i)) ? 1 : 0;
+    }
+    config[512] = this->collapse ? 1 : 0;
+    config[513] = static_cast<unsigned char>(this->foldMode);
+    return util::Fingerprint64(reinterpret_cast<const char*>(config), sizeof(config));
+  }
+
+  // Walks the words of a string:
+  //
+  //     Tokenizer::Iterator it(tokenizer, s, s + len);
+  //     const char* word; size_t wordLength;
+  //     while (it.next(&word, &wordLength)) ...
+  class Iterator {
+  public:
+    Iterator(const Tokenizer& tokenizer, const char* s, const char* end)
+      : tokenizer(tokenizer), scanner(tokenizer.delimiters, s, end), pieceStart(s), end(end), done(false) {}
+
+    bool next(const char** word, size_t* wordLength) {
+      while (!this->done) {
+        const char* a = this->pieceStart;
+        const char* b = this->scanner.next();
+        if (b == this->end) {
+          this->done = true;
+        } else {
+          this->pieceStart = b + 1;
+        }
+
+        if (this->tokenizer.hasPunctuation) {
+          while (a < b && this->tokenizer.punctuation.contains(*a)) a++;
+          while (b > a && this->tokenizer.punctuation.contains(b[-1])) b--;
+        }
+
+        if (a == b && this->tokenizer.collapse) continue;
+
+        *word = a;
+        *wordLength = b - a;
+        return true;
+      }
+
+      return false;
+    }
+
+  private:
+    const Tokenizer& tokenizer;
+    DelimiterScanner scanner;
+    const char* pieceStart;
+    const char* end;
+    bool done;
+  };
+
+  // Where the piece of text holding the k'th-last word of s[0,end) starts:
+  // right after a delimiter, or at s if there are fewer than k words (k > 0).
+  // An Iterator from there to end sees those k words, just like one over all
+  // of s does.
+  const char* lastWordsStart(const char* s, const char* end, size_t k) const {
+    const char* b = end;
+    while (true) {
+      const char* a = b;
+      while (a > s && !this->delimiters.contains(a[-1])) a--;
+
+      bool isWord = true;
+      if (this->collapse) {
+        // Iterator skips pieces that are empty once punctuation is stripped
+        const char* x = a;
+        if (this->hasPunctuation) while (x < b && this->punctuation.contains(*x)) x++;
+        isWord = x < b;
+      }
+      if (isWord && --k == 0) return a;
+      if (a == s) return s;
+      b = a - 1;
+    }
+  }
+
+  // Writes the canonical form of s[0,len) to `out`, which needs room for len
+  // bytes, and returns its length.
+  size_t canonicalize(const char* s, size_t len, char* out) const {
+    Iterator it(*this, s, s + len);
+    const char* word;
+    size_t wordLength;
+    char* p = out;
+
+    while (it.next(&word, &wordLength)) {
+      if (p != out) *p++ = this->joiner;
+      case_fold::fold(this->foldMode, word, wordLength, p);
+      p += wordLength;
+    }
+
+    return p - out;
+  }
+
+  // The same hash token_hash::hash() would give s's canonical form.
+  uint64_t hash(const char* s, size_t len) const {
+    Iterator it(*this, s, s + len);
+    const char* word;
+    size_t wordLength;
+
+    if (!it.next(&word, &wordLength)) return token_hash::token(this->family, "", 0);
+    uint64_t ret = this->wordHash(word, wordLength);
+    while (it.next(&word, &wordLength)) {
+      ret = token_hash::extend(ret, this->wordHash(word, wordLength));
+    }
+    return ret;
+  }
+
+  // True if s[0,len)'s canonical form is key[0,keyLength), which is already
+  // canonical.
+  bool equalsCanonical(const char* s, size_t len, const char* key, size_t keyLength) const {
+    Iterator it(*this, s, s + len);
+    const char* word;
+    size_t wordLength;
+    const char* keyEnd = key + keyLength;
+    bool first = true;
+
+    while (it.next(&word, &wordLength)) {
+      if (!first) {
+        if (key == keyEnd || *key != this->joiner) return false;
+        key++;
+      }
+      first = false;
+
+      if (static_cast<size_t>(keyEnd - key) < wordLength || !this->wordEquals(word, wordLength, key)) return false;
+      key += wordLength;
+    }
+
+    return key == keyEnd;
+  }
+
+private:
+  friend class Iterator;
+
+  Delimiters delimiters;
+  Delimiters punctuation;
+  char joiner;
+  bool collapse;
+  bool hasPunctuation;
+  case_fold::Mode foldMode;
+  token_hash::Family family;
+};
+
+#endif  // TOKENIZER_H_
@@ -1,259 +1,1752 @@
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
-#include <deque>
-#include <unordered_set>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
-#include <node.h>
-#include <node_buffer.h>
-#include <node_object_wrap.h>
-#include <v8.h>
+#include <node_api.h>
+#include <uv.h>
 
-#include "farmhash.h"
+#include "buffer_set.h"
+#include "index_file.h"
+#include "pooled_string.h"
+#include "stream_matcher.h"
+#include "tokenizer.h"
+#include "versioned.h"
 
-using namespace v8;
+// What a synchronous search needs besides the set: its matches (or their
+// ids), and a String document's UTF-8. Reused from call to call, so
+// searching lots of small documents doesn't malloc for each.
+struct SearchScratch {
+  std::vector<PooledString> matches;
+  std::vector<uint32_t> ids;
+  std::string utf8;
+  bool inUse = false;
+};
 
-// It turns out std::string's memory allocations are the bottleneck. Nix them
-// all by using a copy of the original input as the actual data structure.
-//
-// In other words: SimpleString holds a pointer that must be managed by its
-// caller.
-struct PooledString {
-  const char* start; // Points to UnorderedBufferSet.mem
-  size_t length;
+// Per-environment state: the main thread and every worker_thread that
+// requires us get their own.
+struct AddonData {
+  napi_env env;
+  napi_ref constructor = NULL;
+  napi_ref matcherConstructor = NULL;
+  SearchScratch scratch;
+};
 
-  bool operator==(const PooledString& rhs) const {
-    return rhs.length == this->length
-      && memcmp(this->start, rhs.start, this->length) == 0;
+// Lends a search its thread's SearchScratch, empty, for as long as it's in
+// scope. If that's already lent out (JavaScript can call us back from inside
+// a search: from a toString(), say), lends fresh buffers instead.
+class ScratchLoan {
+public:
+  explicit ScratchLoan(AddonData* addon)
+    : owner(addon->scratch.inUse ? NULL : &addon->scratch), scratch(owner ? owner : &this->own) {
+    this->scratch->inUse = true;
   }
 
-  PooledString& operator=(const PooledString& rhs) {
-    this->start = rhs.start;
-    this->length = rhs.length;
-    return *this;
+  ~ScratchLoan() {
+    if (this->owner == NULL) return;
+    // Don't hang on to a huge document's worth
+    static const size_t MaxKeptBytes = 1 << 20;
+    if (this->owner->matches.capacity() * sizeof(PooledString) > MaxKeptBytes) std::vector<PooledString>().swap(this->owner->matches);
+    if (this->owner->ids.capacity() * sizeof(uint32_t) > MaxKeptBytes) std::vector<uint32_t>().swap(this->owner->ids);
+    if (this->owner->utf8.capacity() > MaxKeptBytes) std::string().swap(this->owner->utf8);
+    this->owner->matches.clear();
+    this->owner->ids.clear();
+    this->owner->inUse = false;
   }
 
-  explicit PooledString(): start(NULL), length(-1) {}
-  explicit PooledString(const PooledString& rhs): start(rhs.start), length(rhs.length) {}
-  explicit PooledString(const char* s, size_t l): start(s), length(l) {}
+  SearchScratch* operator->() const { return this->scratch; }
+
+private:
+  SearchScratch* owner; // NULL if we're lending `own`
+  SearchScratch own;
+  SearchScratch* scratch;
+
+  ScratchLoan(const ScratchLoan&);
+  ScratchLoan& operator=(const ScratchLoan&);
 };
 
-namespace std
-{
-  template<> struct hash<PooledString> {
-    size_t operator()(const PooledString& str) const {
-      return util::Fingerprint64(str.start, str.length);
+static void
+delete_addon_data(void* arg) {
+  AddonData* addon = static_cast<AddonData*>(arg);
+  napi_delete_reference(addon->env, addon->constructor);
+  napi_delete_reference(addon->env, addon->matcherConstructor);
+  delete addon;
+}
+
+// Fills argv[0, argc) with our arguments (undefined past the last one) and
+// returns the data we were defined with.
+static void*
+get_args(napi_env env, napi_callback_info info, size_t argc, napi_value* argv, napi_value* self = NULL) {
+  void* data = NULL;
+  napi_get_cb_info(env, info, &argc, argv, self, &data);
+  return data;
+}
+
+static napi_valuetype
+type_of(napi_env env, napi_value value) {
+  napi_valuetype type = napi_undefined;
+  napi_typeof(env, value, &type);
+  return type;
+}
+
+static bool
+is_undefined(napi_env env, napi_value value) {
+  return type_of(env, value) == napi_undefined;
+}
+
+static napi_value
+get_property(napi_env env, napi_value object, const char* name) {
+  napi_value ret;
+  napi_get_named_property(env, object, name, &ret);
+  return ret;
+}
+
+// Value::BooleanValue(): JavaScript truthiness.
+static bool
+boolean_value(napi_env env, napi_value value) {
+  bool ret = false;
+  napi_value b;
+  if (napi_coerce_to_bool(env, value, &b) == napi_ok) napi_get_value_bool(env, b, &ret);
+  return ret;
+}
+
+// Value::Uint32Value(): ToNumber, then modulo 2^32. NaN (and undefined) is 0.
+static uint32_t
+uint32_value(napi_env env, napi_value value) {
+  uint32_t ret = 0;
+  if (type_of(env, value) != napi_number) {
+    napi_value number;
+    if (napi_coerce_to_number(env, value, &number) != napi_ok) {
+      napi_value ignored;
+      napi_get_and_clear_last_exception(env, &ignored);
+      return 0;
     }
-  };
+    value = number;
+  }
+  napi_get_value_uint32(env, value, &ret);
+  return ret;
 }
 
-class UnorderedBufferSet : public node::ObjectWrap {
+static napi_value
+boolean(napi_env env, bool b) {
+  napi_value ret;
+  napi_get_boolean(env, b, &ret);
+  return ret;
+}
+
+static napi_value
+uint32(napi_env env, uint32_t n) {
+  napi_value ret;
+  napi_create_uint32(env, n, &ret);
+  return ret;
+}
+
+// Counts can pass 2^32; a double is exact up to 2^53
+static napi_value
+number(napi_env env, double n) {
+  napi_value ret;
+  napi_create_double(env, n, &ret);
+  return ret;
+}
+
+static napi_value
+undefined(napi_env env) {
+  napi_value ret;
+  napi_get_undefined(env, &ret);
+  return ret;
+}
+
+// Points data and length at the bytes of a Buffer, or of any other
+// TypedArray or DataView. Returns false if value isn't one.
+static bool
+get_bytes(napi_env env, napi_value value, const char** data, size_t* length) {
+  bool isBuffer = false;
+  napi_is_buffer(env, value, &isBuffer);
+  if (!isBuffer) return false;
+
+  void* p = NULL;
+  napi_get_buffer_info(env, value, &p, length);
+  *data = static_cast<const char*>(p);
+  return true;
+}
+
+// Like String::Utf8Value: the UTF-8 of a String, or of whatever else we're
+// given, converted to a String. On failure, it's just an empty String. Short
+// ones don't allocate; long ones go in `buffer`, if given, which keeps its
+// capacity for next time.
+class Utf8Value {
 public:
-  static void Init(Handle<Object> exports);
-  static Persistent<Function> constructor;
+  Utf8Value(napi_env env, napi_value value, std::string* buffer = NULL): data(this->small), len(0) {
+    this->small[0] = '\0';
+
+    if (type_of(env, value) != napi_string) {
+      napi_value string;
+      if (napi_coerce_to_string(env, value, &string) != napi_ok) {
+        napi_value ignored;
+        napi_get_and_clear_last_exception(env, &ignored);
+        return;
+      }
+      value = string;
+    }
+
+    if (napi_get_value_string_utf8(env, value, NULL, 0, &this->len) != napi_ok) return;
+    if (this->len >= sizeof(this->small)) {
+      if (buffer == NULL) buffer = &this->large;
+      buffer->resize(this->len + 1);
+      this->data = &(*buffer)[0];
+    }
+    napi_get_value_string_utf8(env, value, this->data, this->len + 1, &this->len);
+  }
+
+  const char* operator*() const { return this->data; }
+  size_t length() const { return this->len; }
+
+private:
+  char small[256];
+  std::string large;
+  char* data;
+  size_t len;
+
+  Utf8Value(const Utf8Value&);
+  Utf8Value& operator=(const Utf8Value&);
+};
+
+// True if a set built from the caller's Buffer needs its own copy of it.
+// compact() and ids make their own copy of everything they keep, and a
+// filter keeps nothing.
+static bool
+needs_input_copy(const BufferSet::Options& options) {
+  return options.copy && !options.compact && !options.ids && options.bloom != BufferSet::Options::FilterOnly;
+}
+
+// Throws an Error like Node's own, e.g. "ENOENT, no such file or directory
+// 'foo'", with errno, code, syscall and path properties.
+static void
+throw_errno(napi_env env, int err, const char* syscall, const char* path) {
+  const char* code = uv_err_name(-err);
+  std::string message = std::string(code) + ", " + strerror(err);
+  if (path) message += std::string(" '") + path + "'";
 
-  inline bool contains(const char* s, size_t len);
-  std::vector<PooledString> findAllMatches(const char* s, size_t len, size_t maxNgramSize);
+  napi_value codeString, messageString, error, value;
+  napi_create_string_utf8(env, code, NAPI_AUTO_LENGTH, &codeString);
+  napi_create_string_utf8(env, message.data(), message.size(), &messageString);
+  napi_create_error(env, codeString, messageString, &error);
+  napi_create_int32(env, err, &value);
+  napi_set_named_property(env, error, "errno", value);
+  if (syscall) {
+    napi_create_string_utf8(env, syscall, NAPI_AUTO_LENGTH, &value);
+    napi_set_named_property(env, error, "syscall", value);
+  }
+  if (path) {
+    napi_create_string_utf8(env, path, NAPI_AUTO_LENGTH, &value);
+    napi_set_named_property(env, error, "path", value);
+  }
+  napi_throw(env, error);
+}
+
+class UnorderedBufferSet {
+public:
+  static napi_value Init(napi_env env, napi_value exports);
 
 private:
-  std::unordered_set<PooledString> set;
-  char* mem = NULL;
+  typedef BufferSet::Options Options;
+
+  // A BufferSet, and the Buffer it borrows from, if it does.
+  struct Version {
+    BufferSet* set;
+    napi_env env = NULL;
+    napi_ref buffer = NULL;
 
-  explicit UnorderedBufferSet(const char* s, size_t len);
+    explicit Version(BufferSet* set): set(set) {}
+    ~Version() {
+      delete this->set;
+      this->releaseBuffer();
+    }
+
+    void holdBuffer(napi_env env, napi_value buffer) {
+      this->env = env;
+      napi_create_reference(env, buffer, 1, &this->buffer);
+    }
+
+    void releaseBuffer() {
+      if (this->buffer) napi_delete_reference(this->env, this->buffer);
+      this->buffer = NULL;
+    }
+  };
+
+  // What a static factory hands to New() through an External.
+  struct FactoryInput {
+    PreparedInput input;
+    BufferSet* built = NULL; // if set, New() just wraps it and ignores `input`
+    std::shared_ptr<Versioned<Version> > shared; // if set, New() attaches to it
+    uint32_t shareId = 0;
+  };
+
+  // rebuild() publishes a new version while findAllMatchesAsync() calls
+  // finish with the one they pinned. Only the thread that built the set
+  // publishes, so it reads current() without pinning. Sets attach()ed to it
+  // on other threads hold the same versions, and pin even to read
+  // synchronously.
+  std::shared_ptr<Versioned<Version> > versions;
+  uint32_t shareId = 0; // 0 until share()
+  bool attached = false; // if true, another thread's set owns versions
+  uint32_t rebuilding = 0; // rebuild()s in progress
+
+  // Our JavaScript object. Weak, except while ref()ed.
+  napi_env env = NULL;
+  napi_ref wrapper = NULL;
+
+  explicit UnorderedBufferSet(Version* version): versions(std::make_shared<Versioned<Version> >(version)) {}
+  UnorderedBufferSet(std::shared_ptr<Versioned<Version> > versions, uint32_t shareId)
+    : versions(versions), shareId(shareId), attached(true) {}
   ~UnorderedBufferSet();
 
-  static void New(const FunctionCallbackInfo<Value>& args);
-  static void Contains(const FunctionCallbackInfo<Value>& args);
-  static void FindAllMatches(const FunctionCallbackInfo<Value>& args);
+  void wrap(napi_env env, napi_value object);
+  static void Finalize(napi_env env, void* data, void* hint);
+  // Keeps our object alive until unref(), like ObjectWrap::Ref()
+  void ref() { napi_reference_ref(this->env, this->wrapper, NULL); }
+  void unref() { napi_reference_unref(this->env, this->wrapper, NULL); }
+  // Fills argv like get_args() and returns the set we were called on. If
+  // addon isn't NULL, points it at the AddonData of one of our prototype
+  // methods.
+  static UnorderedBufferSet* Unwrap(napi_env env, napi_callback_info info, size_t argc, napi_value* argv,
+      AddonData** addon = NULL);
+
+  BufferSet* current() const { return this->versions->current()->set; }
+  // Throws and returns false if asynchronous calls or other threads are
+  // reading the current version.
+  bool checkModifiable(napi_env env) const;
+
+  // The version a synchronous call reads: current(), or a Pin of it.
+  class Reading {
+  public:
+    explicit Reading(const UnorderedBufferSet* obj) {
+      if (obj->attached) {
+        this->pin = obj->versions->pin();
+        this->set = this->pin->set;
+      } else {
+        this->set = obj->current();
+      }
+    }
+
+    const BufferSet* operator->() const { return this->set; }
+    const BufferSet& operator*() const { return *this->set; }
+
+  private:
+    Versioned<Version>::Pin pin;
+    const BufferSet* set;
+  };
+
+  // Sets share() has handed out, by id. attach() looks them up from any
+  // thread.
+  static std::mutex sharedMutex;
+  static std::map<uint32_t, std::weak_ptr<Versioned<Version> > > shared;
+  static uint32_t nextShareId;
+
+  static bool ParseOptions(napi_env env, napi_value arg, Options* options);
+  static napi_value New(napi_env env, napi_callback_info info);
+  static napi_value FromTextFile(napi_env env, napi_callback_info info);
+  static napi_value FromFile(napi_env env, napi_callback_info info);
+  static napi_value NewFromFactoryInput(napi_env env, AddonData* addon, napi_value options, FactoryInput& input);
+  static napi_value Serialize(napi_env env, napi_callback_info info);
+  static napi_value Contains(napi_env env, napi_callback_info info);
+  static napi_value ContainsBound(napi_env env, napi_callback_info info);
+  static napi_value ContainsIn(napi_env env, const UnorderedBufferSet* obj, napi_value arg);
+  static napi_value FindAllMatches(napi_env env, napi_callback_info info);
+  static napi_value FindAllMatchOffsets(napi_env env, napi_callback_info info);
+  static napi_value GetId(napi_env env, napi_callback_info info);
+  static napi_value FindAllMatchIds(napi_env env, napi_callback_info info);
+  static napi_value CountMatches(napi_env env, napi_callback_info info);
+  static napi_value DistinctMatches(napi_env env, napi_callback_info info);
+  static napi_value ContainsMany(napi_env env, napi_callback_info info);
+  static napi_value FindAllMatchesMany(napi_env env, napi_callback_info info);
+  static napi_value Add(napi_env env, napi_callback_info info);
+  static napi_value AddMany(napi_env env, napi_callback_info info);
+  static napi_value Delete(napi_env env, napi_callback_info info);
+  static napi_value Compact(napi_env env, napi_callback_info info);
+  static napi_value Share(napi_env env, napi_callback_info info);
+  static napi_value Stats(napi_env env, napi_callback_info info);
+  static napi_value Attach(napi_env env, napi_callback_info info);
+
+  // What set.createMatcher() returns: a StreamMatcher over this set, which
+  // it keeps alive.
+  struct Matcher {
+    StreamMatcher matcher;
+    UnorderedBufferSet* obj;
+    napi_ref set;
+
+    explicit Matcher(size_t maxNgramSize): matcher(maxNgramSize) {}
+  };
+  static napi_value CreateMatcher(napi_env env, napi_callback_info info);
+  static napi_value MatcherNew(napi_env env, napi_callback_info info);
+  static void MatcherFinalize(napi_env env, void* data, void* hint);
+  static napi_value MatcherWrite(napi_env env, napi_callback_info info);
+  static napi_value MatcherEnd(napi_env env, napi_callback_info info);
+
+  // Off-main-thread versions, on the libuv threadpool. Any number of threads
+  // may read a version at once; rebuild() replaces it without waiting for
+  // them.
+  struct BuildWork;
+  struct FindAllMatchesWork;
+  static napi_value Build(napi_env env, napi_callback_info info);
+  static napi_value Rebuild(napi_env env, napi_callback_info info);
+  static napi_value QueueBuild(napi_env env, napi_value input, const Options& options, AddonData* addon, UnorderedBufferSet* target);
+  static void BuildExecute(napi_env env, void* data);
+  static void BuildComplete(napi_env env, napi_status status, void* data);
+  static napi_value FindAllMatchesAsync(napi_env env, napi_callback_info info);
+  static void FindAllMatchesExecute(napi_env env, void* data);
+  static void FindAllMatchesComplete(napi_env env, napi_status status, void* data);
 };
 
-Persistent<Function> UnorderedBufferSet::constructor;
+std::mutex UnorderedBufferSet::sharedMutex;
+std::map<uint32_t, std::weak_ptr<Versioned<UnorderedBufferSet::Version> > > UnorderedBufferSet::shared;
+uint32_t UnorderedBufferSet::nextShareId = 1;
+
+UnorderedBufferSet::~UnorderedBufferSet() {
+  if (this->shareId && !this->attached) {
+    // Sets attached already keep working, but nobody else can attach
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    shared.erase(this->shareId);
+  }
+}
+
+void
+UnorderedBufferSet::wrap(napi_env env, napi_value object) {
+  this->env = env;
+  napi_wrap(env, object, this, Finalize, NULL, &this->wrapper);
+
+  // contains() is often called in tight loops, where napi_unwrap() costs
+  // more than the lookup. So each set gets its own, which finds us through
+  // its data instead. It points back at object, so object outlives it.
+  napi_value contains;
+  napi_create_function(env, "contains", NAPI_AUTO_LENGTH, ContainsBound, this, &contains);
+  napi_property_descriptor backPointer = { "set", NULL, NULL, NULL, NULL, object, napi_default, NULL };
+  napi_define_properties(env, contains, 1, &backPointer);
+  napi_property_descriptor property = { "contains", NULL, NULL, NULL, NULL, contains, napi_default, NULL };
+  napi_define_properties(env, object, 1, &property);
+}
+
+void
+UnorderedBufferSet::Finalize(napi_env env, void* data, void* hint) {
+  UnorderedBufferSet* obj = static_cast<UnorderedBufferSet*>(data);
+  napi_delete_reference(env, obj->wrapper);
+  delete obj;
+}
+
+UnorderedBufferSet*
+UnorderedBufferSet::Unwrap(napi_env env, napi_callback_info info, size_t argc, napi_value* argv, AddonData** addon) {
+  napi_value self;
+  void* data = get_args(env, info, argc, argv, &self);
+  if (addon) *addon = static_cast<AddonData*>(data);
+
+  void* obj = NULL;
+  napi_unwrap(env, self, &obj);
+  return static_cast<UnorderedBufferSet*>(obj);
+}
+
+napi_value
+UnorderedBufferSet::Init(napi_env env, napi_value exports) {
+  AddonData* addon = new AddonData;
+  addon->env = env;
+  napi_add_env_cleanup_hook(env, delete_addon_data, addon);
+
+  const napi_property_attributes method = napi_default;
+  const napi_property_attributes staticMethod = napi_static;
+  napi_property_descriptor properties[] = {
+    // Prototype
+    { "contains", NULL, Contains, NULL, NULL, NULL, method, addon },
+    { "findAllMatches", NULL, FindAllMatches, NULL, NULL, NULL, method, addon },
+    { "findAllMatchesAsync", NULL, FindAllMatchesAsync, NULL, NULL, NULL, method, addon },
+    { "findAllMatchOffsets", NULL, FindAllMatchOffsets, NULL, NULL, NULL, method, addon },
+    { "getId", NULL, GetId, NULL, NULL, NULL, method, addon },
+    { "findAllMatchIds", NULL, FindAllMatchIds, NULL, NULL, NULL, method, addon },
+    { "countMatches", NULL, CountMatches, NULL, NULL, NULL, method, addon },
+    { "distinctMatches", NULL, DistinctMatches, NULL, NULL, NULL, method, addon },
+    { "containsMany", NULL, ContainsMany, NULL, NULL, NULL, method, addon },
+    { "findAllMatchesMany", NULL, FindAllMatchesMany, NULL, NULL, NULL, method, addon },
+    { "serialize", NULL, Serialize, NULL, NULL, NULL, method, addon },
+    { "add", NULL, Add, NULL, NULL, NULL, method, addon },
+    { "addMany", NULL, AddMany, NULL, NULL, NULL, method, addon },
+    { "delete", NULL, Delete, NULL, NULL, NULL, method, addon },
+    { "compact", NULL, Compact, NULL, NULL, NULL, method, addon },
+    { "rebuild", NULL, Rebuild, NULL, NULL, NULL, method, addon },
+    { "share", NULL, Share, NULL, NULL, NULL, method, addon },
+    { "stats", NULL, Stats, NULL, NULL, NULL, method, addon },
+    { "createMatcher", NULL, CreateMatcher, NULL, NULL, NULL, method, addon },
+
+    // Static methods
+    { "fromTextFile", NULL, FromTextFile, NULL, NULL, NULL, staticMethod, addon },
+    { "fromFile", NULL, FromFile, NULL, NULL, NULL, staticMethod, addon },
+    { "build", NULL, Build, NULL, NULL, NULL, staticMethod, addon },
+    { "attach", NULL, Attach, NULL, NULL, NULL, staticMethod, addon },
+  };
+
+  napi_value cons;
+  napi_define_class(env, "UnorderedBufferSet", NAPI_AUTO_LENGTH, New, addon,
+      sizeof(properties) / sizeof(properties[0]), properties, &cons);
+  napi_create_reference(env, cons, 1, &addon->constructor);
+  napi_set_named_property(env, exports, "UnorderedBufferSet", cons);
+
+  napi_property_descriptor matcherProperties[] = {
+    { "write", NULL, MatcherWrite, NULL, NULL, NULL, method, addon },
+    { "end", NULL, MatcherEnd, NULL, NULL, NULL, method, addon },
+  };
+  napi_value matcherCons;
+  napi_define_class(env, "Matcher", NAPI_AUTO_LENGTH, MatcherNew, addon,
+      sizeof(matcherProperties) / sizeof(matcherProperties[0]), matcherProperties, &matcherCons);
+  napi_create_reference(env, matcherCons, 1, &addon->matcherConstructor);
+  return exports;
+}
+
+// Reads `{ engine: "ngram" | "automaton", copy: Boolean, threads: Number,
+// compact: Boolean | "suffixes", bloom: Boolean | "only", bitsPerKey: Number,
+// delimiters: String, collapse: Boolean, punctuation: String,
+// fold: "none" | "ascii" | "unicode", hash: "farmhash" | "fast",
+// ids: Boolean, counters: Boolean, perfectHash: Boolean }`. On error, throws
+// and returns false.
+bool
+UnorderedBufferSet::ParseOptions(napi_env env, napi_value arg, Options* options) {
+  const napi_valuetype type = type_of(env, arg);
+  if (type == napi_undefined || type == napi_null) return true;
+
+  if (type != napi_object && type != napi_function) {
+    napi_throw_type_error(env, NULL, "options must be an Object");
+    return false;
+  }
+
+  napi_value engine = get_property(env, arg, "engine");
+  if (!is_undefined(env, engine)) {
+    Utf8Value engineString(env, engine);
+    if (strcmp(*engineString, "automaton") == 0) {
+      options->automaton = true;
+    } else if (strcmp(*engineString, "ngram") == 0) {
+      options->automaton = false;
+    } else {
+      napi_throw_type_error(env, NULL, "options.engine must be \"ngram\" or \"automaton\"");
+      return false;
+    }
+  }
+
+  napi_value copy = get_property(env, arg, "copy");
+  if (!is_undefined(env, copy)) options->copy = boolean_value(env, copy);
+
+  napi_value threads = get_property(env, arg, "threads");
+  if (!is_undefined(env, threads)) options->threads = uint32_value(env, threads);
+
+  napi_value compact = get_property(env, arg, "compact");
+  if (type_of(env, compact) == napi_string) {
+    Utf8Value compactString(env, compact);
+    if (strcmp(*compactString, "suffixes") != 0) {
+      napi_throw_type_error(env, NULL, "options.compact must be a Boolean or \"suffixes\"");
+      return false;
+    }
+    options->compact = options->shareSuffixes = true;
+  } else if (!is_undefined(env, compact)) {
+    options->compact = boolean_value(env, compact);
+  }
+
+  napi_value bloom = get_property(env, arg, "bloom");
+  if (type_of(env, bloom) == napi_string) {
+    Utf8Value bloomString(env, bloom);
+    if (strcmp(*bloomString, "only") != 0) {
+      napi_throw_type_error(env, NULL, "options.bloom must be a Boolean or \"only\"");
+      return false;
+    }
+    options->bloom = Options::FilterOnly;
+  } else if (!is_undefined(env, bloom)) {
+    options->bloom = boolean_value(env, bloom) ? Options::Prefilter : Options::NoBloom;
+  }
+  if (options->bloom == Options::FilterOnly && options->automaton) {
+    napi_throw_type_error(env, NULL, "options.bloom \"only\" needs options.engine \"ngram\"");
+    return false;
+  }
+
+  napi_value bitsPerKey = get_property(env, arg, "bitsPerKey");
+  if (!is_undefined(env, bitsPerKey)) {
+    options->bitsPerKey = uint32_value(env, bitsPerKey);
+    if (options->bitsPerKey < 1 || options->bitsPerKey > 64) {
+      napi_throw_range_error(env, NULL, "options.bitsPerKey must be between 1 and 64");
+      return false;
+    }
+  }
+
+  napi_value delimiters = get_property(env, arg, "delimiters");
+  napi_value collapse = get_property(env, arg, "collapse");
+  napi_value punctuation = get_property(env, arg, "punctuation");
+  napi_value fold = get_property(env, arg, "fold");
+  if (!is_undefined(env, delimiters) || !is_undefined(env, collapse) || !is_undefined(env, punctuation) || !is_undefined(env, fold)) {
+    std::string delimitersString(" ");
+    if (!is_undefined(env, delimiters)) {
+      Utf8Value s(env, delimiters);
+      delimitersString.assign(*s, s.length());
+    }
+    std::string punctuationString;
+    if (!is_undefined(env, punctuation)) {
+      Utf8Value s(env, punctuation);
+      punctuationString.assign(*s, s.length());
+    }
+    if (delimitersString.empty()) {
+      napi_throw_type_error(env, NULL, "options.delimiters must not be empty");
+      return false;
+    }
+
+    case_fold::Mode foldMode = case_fold::None;
+    if (!is_undefined(env, fold)) {
+      Utf8Value foldString(env, fold);
+      if (strcmp(*foldString, "ascii") == 0) {
+        foldMode = case_fold::Ascii;
+      } else if (strcmp(*foldString, "unicode") == 0) {
+        foldMode = case_fold::Utf8;
+      } else if (strcmp(*foldString, "none") != 0) {
+        napi_throw_type_error(env, NULL, "options.fold must be \"none\", \"ascii\" or \"unicode\"");
+        return false;
+      }
+    }
+
+    options->tokenizer = Tokenizer(delimitersString.data(), delimitersString.size(),
+        boolean_value(env, collapse),
+        punctuationString.data(), punctuationString.size(),
+        foldMode);
+  }
+
+  napi_value hash = get_property(env, arg, "hash");
+  if (!is_undefined(env, hash)) {
+    Utf8Value hashString(env, hash);
+    if (strcmp(*hashString, "farmhash") == 0) {
+      options->tokenizer.setHashFamily(token_hash::FarmHash);
+    } else if (strcmp(*hashString, "fast") == 0) {
+      options->tokenizer.setHashFamily(token_hash::Fast);
+    } else {
+      napi_throw_type_error(env, NULL, "options.hash must be \"farmhash\" or \"fast\"");
+      return false;
+    }
+  }
+
+  napi_value ids = get_property(env, arg, "ids");
+  if (!is_undefined(env, ids)) options->ids = boolean_value(env, ids);
+  if (options->ids && options->bloom == Options::FilterOnly) {
+    napi_throw_type_error(env, NULL, "options.ids needs a set that keeps its keys, not bloom: \"only\"");
+    return false;
+  }
+  if (options->ids && options->tokenizer.joinerByte() == '\t') {
+    // Keys would contain tabs, but a tab is where a key ends and its id starts
+    napi_throw_type_error(env, NULL, "options.ids needs a delimiter other than a tab");
+    return false;
+  }
+
+  napi_value counters = get_property(env, arg, "counters");
+  if (!is_undefined(env, counters)) options->counters = boolean_value(env, counters);
+
+  napi_value perfectHash = get_property(env, arg, "perfectHash");
+  if (!is_undefined(env, perfectHash)) options->perfectHash = boolean_value(env, perfectHash);
+  if (options->perfectHash && options->bloom == Options::FilterOnly) {
+    napi_throw_type_error(env, NULL, "options.perfectHash needs a set that keeps its keys, not bloom: \"only\"");
+    return false;
+  }
+
+  return true;
+}
+
+napi_value
+UnorderedBufferSet::New(napi_env env, napi_callback_info info) {
+  napi_value argv[2], self, newTarget;
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 2, argv, &self));
+
+  napi_get_new_target(env, info, &newTarget);
+  if (newTarget == NULL) {
+    // Invoked as plain function `MyObject(...)`, turn into construct call
+    napi_value cons, ret = NULL;
+    napi_get_reference_value(env, addon->constructor, &cons);
+    napi_new_instance(env, cons, 2, argv, &ret);
+    return ret;
+  }
+
+  // Invoked as constructor: `new MyObject(...)`
+  FactoryInput* factoryInput = NULL;
+  if (type_of(env, argv[0]) == napi_external) {
+    // We're being called from a static factory, which prepared the input
+    void* p = NULL;
+    napi_get_value_external(env, argv[0], &p);
+    factoryInput = static_cast<FactoryInput*>(p);
+  }
+
+  UnorderedBufferSet* obj;
+  if (factoryInput && (factoryInput->built || factoryInput->shared)) {
+    // Built on the threadpool, or shared from another thread
+    obj = factoryInput->shared
+      ? new UnorderedBufferSet(factoryInput->shared, factoryInput->shareId)
+      : new UnorderedBufferSet(new Version(factoryInput->built));
+  } else {
+    Options options;
+    if (!ParseOptions(env, argv[1], &options)) return NULL;
+
+    PreparedInput ownInput;
+    PreparedInput* input = &ownInput;
+    bool borrowed = false;
+    const char* s;
+    size_t len;
+
+    if (factoryInput) {
+      input = &factoryInput->input;
+    } else if (get_bytes(env, argv[0], &s, &len)) {
+      if (needs_input_copy(options)) {
+        ownInput.memory.copy(s, len);
+      } else {
+        ownInput.memory.borrow(s, len);
+        borrowed = true;
+      }
+    } else {
+      napi_throw_type_error(env, NULL, "input must be a Buffer");
+      return NULL;
+    }
+
+    Version* version = new Version(new BufferSet(*input, options));
+    if (borrowed && version->set->isBorrowed()) version->holdBuffer(env, argv[0]);
+    obj = new UnorderedBufferSet(version);
+  }
+
+  obj->wrap(env, self);
+  return self;
+}
+
+// Calls the constructor with `input` and `options`.
+napi_value
+UnorderedBufferSet::NewFromFactoryInput(napi_env env, AddonData* addon, napi_value options, FactoryInput& input) {
+  napi_value argv[2], cons, ret = NULL;
+  napi_create_external(env, &input, NULL, NULL, &argv[0]);
+  argv[1] = options;
+  napi_get_reference_value(env, addon->constructor, &cons);
+  napi_new_instance(env, cons, 2, argv, &ret);
+  return ret;
+}
+
+// UnorderedBufferSet.fromTextFile(path[, options]): like the constructor, but
+// maps a newline-separated file instead of copying a Buffer.
+napi_value
+UnorderedBufferSet::FromTextFile(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 2, argv));
+
+  Utf8Value path(env, argv[0]);
+
+  FactoryInput input;
+  const char* syscall = NULL;
+  if (!input.input.memory.map(*path, &syscall)) {
+    throw_errno(env, errno, syscall, *path);
+    return NULL;
+  }
+
+  return NewFromFactoryInput(env, addon, argv[1], input);
+}
+
+// UnorderedBufferSet.fromFile(path[, options]): maps a file written by
+// serialize() and uses its hash table as-is, read-only. Processes that map the
+// same file share one copy of it in the page cache.
+napi_value
+UnorderedBufferSet::FromFile(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 2, argv));
+
+  Utf8Value path(env, argv[0]);
+
+  FactoryInput input;
+  const char* syscall = NULL;
+  if (!input.input.memory.map(*path, &syscall)) {
+    throw_errno(env, errno, syscall, *path);
+    return NULL;
+  }
+
+  Options options;
+  if (!ParseOptions(env, argv[1], &options)) return NULL;
+
+  index_file::Contents index;
+  const char* error = index_file::parse(input.input.memory.data(), input.input.memory.size(),
+      pooled_string_hash_id(options.tokenizer.hashFamily()), options.tokenizer.fingerprint(), options.ids,
+      sizeof(PooledStringTable::Slot), &index);
+  if (error) {
+    napi_throw_error(env, NULL, error);
+    return NULL;
+  }
+  input.input.index = &index;
+
+  return NewFromFactoryInput(env, addon, argv[1], input);
+}
+
+// set.serialize(path): writes an index file for fromFile().
+napi_value
+UnorderedBufferSet::Serialize(napi_env env, napi_callback_info info) {
+  napi_value arg;
+  Reading set(Unwrap(env, info, 1, &arg));
+
+  if (set->isFilterOnly()) {
+    napi_throw_error(env, NULL, "a bloom: \"only\" set has no keys to serialize");
+    return NULL;
+  }
+
+  Utf8Value path(env, arg);
+
+  const char* syscall = NULL;
+  if (!set->serialize(*path, &syscall)) {
+    throw_errno(env, errno, syscall, *path);
+  }
+  return NULL;
+}
+
+// set.stats(): how full the table is, how far keys are from home, where
+// memory goes and, with counters: true, what searches have done.
+napi_value
+UnorderedBufferSet::Stats(napi_env env, napi_callback_info info) {
+  Reading set(Unwrap(env, info, 0, NULL));
+  const BufferSet::Stats stats = set->stats();
+
+  napi_value ret, value;
+  napi_create_object(env, &ret);
+  napi_set_named_property(env, ret, "keys", number(env, stats.keys));
+  napi_set_named_property(env, ret, "capacity", number(env, stats.capacity));
+  napi_set_named_property(env, ret, "loadFactor", number(env, stats.capacity ? double(stats.keys) / stats.capacity : 0));
+  napi_get_boolean(env, stats.perfectHash, &value);
+  napi_set_named_property(env, ret, "perfectHash", value);
+
+  // probeLengths[i] keys take i + 1 probes to find
+  double totalProbes = 0;
+  napi_create_array_with_length(env, stats.probeLengths.size(), &value);
+  for (size_t i = 0; i < stats.probeLengths.size(); i++) {
+    napi_set_element(env, value, i, number(env, stats.probeLengths[i]));
+    totalProbes += double(i + 1) * stats.probeLengths[i];
+  }
+  napi_set_named_property(env, ret, "probeLengths", value);
+  napi_set_named_property(env, ret, "meanProbeLength", number(env, stats.keys ? totalProbes / stats.keys : 0));
+  napi_set_named_property(env, ret, "maxProbeLength", number(env, stats.probeLengths.size()));
+
+  napi_create_object(env, &value);
+  napi_set_named_property(env, value, "pool", number(env, stats.poolBytes));
+  napi_set_named_property(env, value, "arena", number(env, stats.arenaBytes));
+  napi_set_named_property(env, value, "table", number(env, stats.tableBytes));
+  napi_set_named_property(env, value, "bloom", number(env, stats.bloomBytes));
+  napi_set_named_property(env, value, "automaton", number(env, stats.automatonBytes));
+  napi_set_named_property(env, ret, "memory", value);
+
+  if (set->options().counters) {
+    const SearchCounters counters = set->counters();
+    napi_create_object(env, &value);
+    napi_set_named_property(env, value, "searches", number(env, counters.searches));
+    napi_set_named_property(env, value, "lookups", number(env, counters.lookups));
+    napi_set_named_property(env, value, "hits", number(env, counters.hits));
+    napi_set_named_property(env, value, "filtered", number(env, counters.filtered));
+    napi_set_named_property(env, value, "probes", number(env, counters.probes));
+    napi_set_named_property(env, value, "bytesHashed", number(env, counters.bytesHashed));
+    napi_set_named_property(env, ret, "counters", value);
+  }
+
+  return ret;
+}
+
+// Calls f(data, length) with the bytes of a Buffer, or a String's UTF-8 (in
+// `buffer`, if it's long and buffer isn't NULL).
+template<typename F> static void
+with_bytes(napi_env env, napi_value arg, F f, std::string* buffer = NULL) {
+  const char* data;
+  size_t len;
+  if (get_bytes(env, arg, &data, &len)) {
+    f(data, len);
+  } else {
+    // We can convert it to utf-8. On failure, it's just an empty String.
+    Utf8Value argString(env, arg, buffer);
+    f(*argString, argString.length());
+  }
+}
+
+// set.contains(key): takes a Buffer or a String. Each set has its own
+// contains(), bound to it (see wrap()); this is the prototype's, for calling
+// on some other set.
+napi_value
+UnorderedBufferSet::Contains(napi_env env, napi_callback_info info) {
+  napi_value arg; // Buffer or String
+  UnorderedBufferSet* obj = Unwrap(env, info, 1, &arg);
+  return ContainsIn(env, obj, arg);
+}
+
+napi_value
+UnorderedBufferSet::ContainsBound(napi_env env, napi_callback_info info) {
+  napi_value arg; // Buffer or String
+  UnorderedBufferSet* obj = static_cast<UnorderedBufferSet*>(get_args(env, info, 1, &arg));
+  return ContainsIn(env, obj, arg);
+}
+
+// Doesn't allocate: not even for a String, unless it's long.
+napi_value
+UnorderedBufferSet::ContainsIn(napi_env env, const UnorderedBufferSet* obj, napi_value arg) {
+  Reading set(obj);
+
+  bool ret = false;
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    ret = set->contains(data, len);
+  });
+  return boolean(env, ret);
+}
+
+static bool
+is_ascii(const char* s, size_t len) {
+  unsigned char bits = 0;
+  for (size_t i = 0; i < len; i++) bits |= s[i];
+  return (bits & 0x80) == 0;
+}
+
+// An ASCII key's UTF-8 is also its Latin-1, which V8 copies straight into a
+// one-byte String without decoding anything.
+static napi_value
+key_to_string(napi_env env, const PooledString& key) {
+  napi_value ret;
+  if (is_ascii(key.start, key.length)) {
+    napi_create_string_latin1(env, key.start, key.length, &ret);
+  } else {
+    napi_create_string_utf8(env, key.start, key.length, &ret);
+  }
+  return ret;
+}
+
+static napi_value
+matches_to_array(napi_env env, const std::vector<PooledString>& matches) {
+  const size_t size = matches.size();
+  napi_value ret;
+  napi_create_array_with_length(env, size, &ret);
+  for (size_t i = 0; i < size; i++) {
+    napi_set_element(env, ret, i, key_to_string(env, matches[i]));
+  }
+  return ret;
+}
+
+// Reads the `{ threads: Number }` findAllMatches() and friends take. 0 means
+// one per CPU; the default is 1. If `top` isn't NULL, also reads `top` (0,
+// the default, means all). On error, throws and returns false.
+static bool
+parse_search_options(napi_env env, napi_value arg, uint32_t* threads, uint32_t* top = NULL) {
+  *threads = 1;
+  if (top) *top = 0;
+
+  const napi_valuetype type = type_of(env, arg);
+  if (type == napi_undefined || type == napi_null) return true;
+  if (type != napi_object) {
+    napi_throw_type_error(env, NULL, "options must be an Object");
+    return false;
+  }
+
+  napi_value value = get_property(env, arg, "threads");
+  if (!is_undefined(env, value)) *threads = uint32_value(env, value);
+  if (top) {
+    value = get_property(env, arg, "top");
+    if (!is_undefined(env, value)) *top = uint32_value(env, value);
+  }
+  return true;
+}
+
+// set.findAllMatches(doc, maxNgramSize[, { threads }]): with threads, a long
+// doc is split between that many threads.
+napi_value
+UnorderedBufferSet::FindAllMatches(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  AddonData* addon;
+  Reading set(Unwrap(env, info, 3, argv, &addon));
 
-static size_t
-count_char_in_str(char ch, const char* s, size_t len) {
-  size_t ret = 0;
+  napi_value arg = argv[0]; // Buffer or String
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+  uint32_t threads;
+  if (!parse_search_options(env, argv[2], &threads)) return NULL;
 
-  while (len > 0) {
-    if (*s == ch) ret++;
-    len--;
-    s++;
+  ScratchLoan scratch(addon);
+  napi_value ret = NULL;
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    set->findMatches(data, len, maxNgramSize, &scratch->matches, NULL, threads);
+    ret = matches_to_array(env, scratch->matches);
+  }, &scratch->utf8);
+  return ret;
+}
+
+// Returns a Uint32Array of [ start0, length0, start1, length1, ... ], where
+// starts are relative to `doc`, and points `pairs` at its contents. We'll
+// never allocate a String.
+static napi_value
+matches_to_offsets(napi_env env, const char* doc, const std::vector<PooledString>& matches, uint32_t** pairs) {
+  const size_t size = matches.size();
+  void* data = NULL;
+  napi_value buffer, ret;
+  napi_create_arraybuffer(env, size * 2 * sizeof(uint32_t), &data, &buffer);
+  uint32_t* out = static_cast<uint32_t*>(data);
+  for (size_t i = 0; i < size; i++) {
+    out[i * 2] = matches[i].start - doc;
+    out[i * 2 + 1] = matches[i].length;
+  }
+  napi_create_typedarray(env, napi_uint32_array, size * 2, buffer, 0, &ret);
+  *pairs = out;
+  return ret;
+}
+
+// Turns [ start, length, ... ] pairs of byte offsets into UTF-8 `s` into
+// pairs of UTF-16 offsets, which is how JavaScript indexes Strings.
+static void
+utf8_offsets_to_utf16(const char* s, size_t len, uint32_t* pairs, size_t nPairs) {
+  // Visit every start and end in byte order, counting UTF-16 code units as we
+  // go. Matches are ordered by end, but their starts aren't, so sort.
+  std::vector<std::pair<uint32_t, uint32_t*> > points;
+  points.reserve(nPairs * 2);
+  for (size_t i = 0; i < nPairs; i++) {
+    pairs[i * 2 + 1] += pairs[i * 2]; // length => end
+    points.push_back(std::make_pair(pairs[i * 2], &pairs[i * 2]));
+    points.push_back(std::make_pair(pairs[i * 2 + 1], &pairs[i * 2 + 1]));
+  }
+  std::sort(points.begin(), points.end());
+
+  size_t byteOffset = 0;
+  uint32_t utf16Offset = 0;
+  for (auto i = points.begin(); i < points.end(); i++) {
+    for (; byteOffset < i->first && byteOffset < len; byteOffset++) {
+      const unsigned char c = s[byteOffset];
+      if ((c & 0xc0) != 0x80) utf16Offset++; // not a continuation byte
+      if (c >= 0xf0) utf16Offset++; // needs a surrogate pair
+    }
+    *i->second = utf16Offset;
   }
 
+  for (size_t i = 0; i < nPairs; i++) {
+    pairs[i * 2 + 1] -= pairs[i * 2]; // end => length
+  }
+}
+
+// set.findAllMatchOffsets(doc, maxNgramSize[, { threads }]): like
+// findAllMatches(), but returns a Uint32Array of [ start, length ] pairs. For
+// a Buffer they're byte offsets; for a String they're String indices, ready
+// for substr(). Offsets are 32 bits, so doc must be under 4 GiB.
+napi_value
+UnorderedBufferSet::FindAllMatchOffsets(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  AddonData* addon;
+  Reading set(Unwrap(env, info, 3, argv, &addon));
+
+  napi_value arg = argv[0]; // Buffer or String
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+  uint32_t threads;
+  if (!parse_search_options(env, argv[2], &threads)) return NULL;
+
+  ScratchLoan scratch(addon);
+  std::vector<PooledString>& ret = scratch->matches;
+  const char* data;
+  size_t len;
+  uint32_t* pairs;
+  if (get_bytes(env, arg, &data, &len)) {
+    if (static_cast<uint32_t>(len) != len) {
+      napi_throw_range_error(env, NULL, "findAllMatchOffsets() needs a document under 4 GiB");
+      return NULL;
+    }
+    set->findMatches(data, len, maxNgramSize, &ret, NULL, threads);
+    return matches_to_offsets(env, data, ret, &pairs);
+  } else {
+    Utf8Value argString(env, arg, &scratch->utf8);
+    set->findMatches(*argString, argString.length(), maxNgramSize, &ret, NULL, threads);
+    napi_value offsets = matches_to_offsets(env, *argString, ret, &pairs);
+    size_t utf16Length = 0;
+    const bool isString = type_of(env, arg) == napi_string;
+    if (isString) napi_get_value_string_utf16(env, arg, NULL, 0, &utf16Length);
+    if (!isString || argString.length() != utf16Length) {
+      // There's non-ASCII in there, so byte offsets aren't String indices
+      utf8_offsets_to_utf16(*argString, argString.length(), pairs, ret.size());
+    }
+    return offsets;
+  }
+}
+
+static napi_value
+uint32_array(napi_env env, const std::vector<uint32_t>& values) {
+  void* out = NULL;
+  napi_value buffer, ret;
+  napi_create_arraybuffer(env, values.size() * sizeof(uint32_t), &out, &buffer);
+  if (!values.empty()) memcpy(out, values.data(), values.size() * sizeof(uint32_t));
+  napi_create_typedarray(env, napi_uint32_array, values.size(), buffer, 0, &ret);
   return ret;
 }
 
-UnorderedBufferSet::UnorderedBufferSet(const char* s, size_t len)
-{
-  this->mem = new char[len];
-  memcpy(this->mem, s, len);
+// Throws and returns false if the set wasn't built with ids.
+static bool
+check_ids(napi_env env, bool hasIds) {
+  if (hasIds) return true;
+  napi_throw_error(env, NULL, "this set has no ids; build it with ids: true");
+  return false;
+}
+
+// set.getId(key): the id of a Buffer or String, or undefined if it isn't a
+// key.
+napi_value
+UnorderedBufferSet::GetId(napi_env env, napi_callback_info info) {
+  napi_value arg; // Buffer or String
+  Reading set(Unwrap(env, info, 1, &arg));
+
+  if (!check_ids(env, set->hasIds())) return NULL;
+
+  bool found = false;
+  uint32_t id = 0;
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    found = set->getId(data, len, &id);
+  });
+  return found ? uint32(env, id) : undefined(env);
+}
+
+// set.findAllMatchIds(doc, maxNgramSize[, { threads }]): like
+// findAllMatches(), but returns a Uint32Array of their ids, without creating
+// any Strings.
+napi_value
+UnorderedBufferSet::FindAllMatchIds(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  AddonData* addon;
+  Reading set(Unwrap(env, info, 3, argv, &addon));
+
+  if (!check_ids(env, set->hasIds())) return NULL;
 
-  this->set.reserve(count_char_in_str('\n', this->mem, len) + 1);
+  napi_value arg = argv[0]; // Buffer or String
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+  uint32_t threads;
+  if (!parse_search_options(env, argv[2], &threads)) return NULL;
+
+  ScratchLoan scratch(addon);
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    set->findMatches(data, len, maxNgramSize, NULL, &scratch->ids, threads);
+  }, &scratch->utf8);
+  return uint32_array(env, scratch->ids);
+}
+
+// set.countMatches(doc, maxNgramSize[, { threads, top }]): how often each key
+// matched, as { matches: [ String ], counts: Uint32Array } (and, with ids,
+// ids: Uint32Array). Each key appears once, as its first match, in order;
+// with top, just the top most frequent are left, most first.
+napi_value
+UnorderedBufferSet::CountMatches(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  Reading set(Unwrap(env, info, 3, argv));
+
+  napi_value arg = argv[0]; // Buffer or String
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+  uint32_t threads, top;
+  if (!parse_search_options(env, argv[2], &threads, &top)) return NULL;
 
-  const char* tokenStart = this->mem;
-  const char* end = this->mem + len;
+  napi_value ret;
+  napi_create_object(env, &ret);
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    std::vector<BufferSet::MatchCount> counts = set->countMatches(data, len, maxNgramSize, threads);
+    if (top != 0) BufferSet::keepTop(&counts, top);
 
-  for (const char* p = tokenStart; p < end; p++) {
-    if (*p == '\n') {
-      this->set.insert(PooledString(tokenStart, p - tokenStart));
-      tokenStart = p + 1;
+    std::vector<PooledString> matches;
+    std::vector<uint32_t> numbers, ids;
+    matches.reserve(counts.size());
+    numbers.reserve(counts.size());
+    for (auto i = counts.begin(); i < counts.end(); i++) {
+      matches.push_back(PooledString(i->start, i->length));
+      numbers.push_back(i->count);
+      if (set->hasIds()) ids.push_back(i->id);
     }
+
+    napi_set_named_property(env, ret, "matches", matches_to_array(env, matches));
+    napi_set_named_property(env, ret, "counts", uint32_array(env, numbers));
+    if (set->hasIds()) napi_set_named_property(env, ret, "ids", uint32_array(env, ids));
+  });
+  return ret;
+}
+
+// set.distinctMatches(doc, maxNgramSize[, { threads }]): like
+// findAllMatches(), but each key just once, as its first match.
+napi_value
+UnorderedBufferSet::DistinctMatches(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  Reading set(Unwrap(env, info, 3, argv));
+
+  napi_value arg = argv[0]; // Buffer or String
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+  uint32_t threads;
+  if (!parse_search_options(env, argv[2], &threads)) return NULL;
+
+  napi_value ret = NULL;
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    std::vector<BufferSet::MatchCount> counts = set->countMatches(data, len, maxNgramSize, threads);
+    std::vector<PooledString> matches;
+    matches.reserve(counts.size());
+    for (auto i = counts.begin(); i < counts.end(); i++) matches.push_back(PooledString(i->start, i->length));
+    ret = matches_to_array(env, matches);
+  });
+  return ret;
+}
+
+// set.containsMany(buffer[, separator]): splits buffer on separator (a
+// one-character String; default "\n") and returns a Uint8Array with a 1 for
+// each key that's in the set and a 0 for each that isn't.
+napi_value
+UnorderedBufferSet::ContainsMany(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  Reading set(Unwrap(env, info, 2, argv));
+
+  const char* data;
+  size_t len;
+  if (!get_bytes(env, argv[0], &data, &len)) {
+    napi_throw_type_error(env, NULL, "keys must be a Buffer");
+    return NULL;
   }
 
-  if (tokenStart < end) {
-    this->set.insert(PooledString(tokenStart, end - tokenStart));
+  char separator = '\n';
+  if (!is_undefined(env, argv[1])) {
+    Utf8Value separatorString(env, argv[1]);
+    if (separatorString.length() != 1) {
+      napi_throw_type_error(env, NULL, "separator must be a single ASCII character");
+      return NULL;
+    }
+    separator = (*separatorString)[0];
   }
+
+  const size_t size = count_keys(data, len, separator);
+  void* out = NULL;
+  napi_value buffer, ret;
+  napi_create_arraybuffer(env, size, &out, &buffer);
+  set->containsMany(data, len, separator, static_cast<uint8_t*>(out));
+  napi_create_typedarray(env, napi_uint8_array, size, buffer, 0, &ret);
+  return ret;
 }
 
-UnorderedBufferSet::~UnorderedBufferSet()
-{
-  if (this->mem) free(this->mem);
+// set.findAllMatchesMany(docs, maxNgramSize): returns an Array with
+// findAllMatches(doc, maxNgramSize) for each Buffer or String in docs.
+napi_value
+UnorderedBufferSet::FindAllMatchesMany(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  AddonData* addon;
+  Reading set(Unwrap(env, info, 2, argv, &addon));
+
+  bool isArray = false;
+  napi_is_array(env, argv[0], &isArray);
+  if (!isArray) {
+    napi_throw_type_error(env, NULL, "docs must be an Array");
+    return NULL;
+  }
+
+  napi_value docs = argv[0];
+  uint32_t maxNgramSize = uint32_value(env, argv[1]);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+
+  uint32_t size = 0;
+  napi_get_array_length(env, docs, &size);
+  napi_value ret;
+  napi_create_array_with_length(env, size, &ret);
+
+  ScratchLoan scratch(addon);
+  for (uint32_t i = 0; i < size; i++) {
+    napi_value doc;
+    napi_get_element(env, docs, i, &doc);
+
+    with_bytes(env, doc, [&](const char* data, size_t len) {
+      scratch->matches.clear();
+      set->findMatches(data, len, maxNgramSize, &scratch->matches, NULL);
+      napi_set_element(env, ret, i, matches_to_array(env, scratch->matches));
+    }, &scratch->utf8);
+  }
+
+  return ret;
 }
 
 bool
-UnorderedBufferSet::contains(const char* s, size_t len)
-{
-  const PooledString str(s, len);
-  return this->set.count(str) != 0;
-}
-
-std::vector<PooledString>
-UnorderedBufferSet::findAllMatches(const char* s, size_t len, size_t maxNgramSize) {
-  std::vector<PooledString> ret;
-  std::deque<const char*> tokenStarts;
-  const char* lastP = s;
-  const char* end = s + len;
-
-  tokenStarts.push_back(s);
-
-  while (true) {
-    const char* p = static_cast<const char*>(memchr(lastP, ' ', end - lastP));
-    if (p == NULL) p = s + len;
-
-    // Add s[tokenStarts[0],pos), s[tokenStarts[1],pos), ... for every token
-    // in the set
-    for (auto i = tokenStarts.begin(); i < tokenStarts.end(); i++) {
-      const char* tokenStart = *i;
-      PooledString needle(tokenStart, p - tokenStart);
-      if (this->set.count(needle) != 0) {
-        ret.push_back(needle);
-      }
+UnorderedBufferSet::checkModifiable(napi_env env) const {
+  const char* message;
+  if (this->attached) {
+    message = "can't modify an attach()ed set; rebuild() the set it was shared from";
+  } else if (this->shareId) {
+    message = "can't modify a shared set; rebuild() it instead";
+  } else if (this->versions->isPinned()) {
+    message = "can't modify a set while findAllMatchesAsync() is reading it; rebuild() it instead";
+  } else {
+    return true;
+  }
+  napi_throw_error(env, NULL, message);
+  return false;
+}
+
+// set.add(key[, id]): adds a Buffer or String, and with ids, maps it to id.
+// Returns false if it was already there (and keeps its old id).
+napi_value
+UnorderedBufferSet::Add(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  UnorderedBufferSet* obj = Unwrap(env, info, 2, argv);
+
+  if (!obj->checkModifiable(env)) return NULL;
+
+  const bool ids = obj->current()->hasIds();
+  if (ids && type_of(env, argv[1]) != napi_number) {
+    napi_throw_type_error(env, NULL, "id must be a Number");
+    return NULL;
+  }
+  const uint32_t id = ids ? uint32_value(env, argv[1]) : 0;
+
+  napi_value ret = NULL;
+  with_bytes(env, argv[0], [&](const char* data, size_t len) {
+    if (memchr(data, '\n', len) != NULL) {
+      napi_throw_type_error(env, NULL, "key must not contain a newline");
+      return;
+    }
+    if (ids && memchr(data, '\t', len) != NULL) {
+      napi_throw_type_error(env, NULL, "key must not contain a tab");
+      return;
     }
+    ret = boolean(env, obj->current()->add(data, len, id));
+  });
+  return ret;
+}
 
-    if (tokenStarts.size() == maxNgramSize) tokenStarts.pop_front();
+// set.addMany(buffer[, separator]): splits buffer like containsMany() and
+// adds every key. With ids, keys are "key\tid", like the constructor's lines.
+// Returns the number of keys that weren't there yet.
+napi_value
+UnorderedBufferSet::AddMany(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  UnorderedBufferSet* obj = Unwrap(env, info, 2, argv);
 
-    if (p == s + len) break;
+  const char* data;
+  size_t len;
+  if (!get_bytes(env, argv[0], &data, &len)) {
+    napi_throw_type_error(env, NULL, "keys must be a Buffer");
+    return NULL;
+  }
 
-    lastP = p + 1;
-    tokenStarts.push_back(lastP);
+  char separator = '\n';
+  if (!is_undefined(env, argv[1])) {
+    Utf8Value separatorString(env, argv[1]);
+    if (separatorString.length() != 1) {
+      napi_throw_type_error(env, NULL, "separator must be a single ASCII character");
+      return NULL;
+    }
+    separator = (*separatorString)[0];
+  }
+
+  if (separator != '\n' && memchr(data, '\n', len) != NULL) {
+    napi_throw_type_error(env, NULL, "keys must not contain a newline");
+    return NULL;
+  }
+  if (separator == '\t' && obj->current()->hasIds()) {
+    napi_throw_type_error(env, NULL, "separator must not be a tab: it separates keys from ids");
+    return NULL;
   }
 
+  if (!obj->checkModifiable(env)) return NULL;
+
+  napi_value ret;
+  napi_create_double(env, static_cast<double>(obj->current()->addMany(data, len, separator)), &ret);
   return ret;
 }
 
-void
-UnorderedBufferSet::Init(Handle<Object> exports) {
-  Isolate* isolate = Isolate::GetCurrent();
+// set.delete(key): removes a Buffer or String. Returns false if it wasn't
+// there.
+napi_value
+UnorderedBufferSet::Delete(napi_env env, napi_callback_info info) {
+  napi_value arg;
+  UnorderedBufferSet* obj = Unwrap(env, info, 1, &arg);
+
+  if (!obj->checkModifiable(env)) return NULL;
+
+  if (obj->current()->isFilterOnly()) {
+    napi_throw_error(env, NULL, "can't delete from a bloom: \"only\" set");
+    return NULL;
+  }
+
+  napi_value ret = NULL;
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    ret = boolean(env, obj->current()->remove(data, len));
+  });
+  return ret;
+}
+
+// set.compact([ "suffixes" ]): like the compact option, now. Frees the bytes
+// of deleted keys, moves added keys into the pool, and resizes the Bloom
+// filter and rebuilds the automaton, if there are any.
+napi_value
+UnorderedBufferSet::Compact(napi_env env, napi_callback_info info) {
+  napi_value arg;
+  UnorderedBufferSet* obj = Unwrap(env, info, 1, &arg);
+
+  bool shareSuffixes = false;
+  if (type_of(env, arg) == napi_string) {
+    Utf8Value modeString(env, arg);
+    if (strcmp(*modeString, "suffixes") != 0) {
+      napi_throw_type_error(env, NULL, "mode must be \"suffixes\" or undefined");
+      return NULL;
+    }
+    shareSuffixes = true;
+  }
+
+  if (!obj->checkModifiable(env)) return NULL;
+
+  obj->current()->compact(shareSuffixes);
+  if (!obj->current()->isBorrowed()) obj->versions->current()->releaseBuffer();
+  return NULL;
+}
+
+// set.share(): returns a Number that UnorderedBufferSet.attach() takes on any
+// thread, to read this set without copying it. This set can only change by
+// rebuild() from then on, and the attached sets see what it rebuilds.
+napi_value
+UnorderedBufferSet::Share(napi_env env, napi_callback_info info) {
+  UnorderedBufferSet* obj = Unwrap(env, info, 0, NULL);
+
+  if (!obj->shareId) {
+    if (obj->rebuilding) {
+      napi_throw_error(env, NULL, "can't share a set while rebuild() is in progress");
+      return NULL;
+    }
+    if (obj->current()->isBorrowed()) {
+      napi_throw_error(env, NULL, "can't share a set that borrows a Buffer; build it with copy: true");
+      return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    obj->shareId = nextShareId++;
+    shared[obj->shareId] = obj->versions;
+  }
 
-  // Prepare constructor template
-  Local<FunctionTemplate> tpl = FunctionTemplate::New(isolate, New);
-  tpl->SetClassName(String::NewFromUtf8(isolate, "UnorderedBufferSet"));
-  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  return uint32(env, obj->shareId);
+}
+
+// UnorderedBufferSet.attach(id): a read-only set that reads whatever the set
+// that returned id from share() reads, from this thread.
+napi_value
+UnorderedBufferSet::Attach(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 2, argv));
 
-  // Prototype
-  NODE_SET_PROTOTYPE_METHOD(tpl, "contains", Contains);
-  NODE_SET_PROTOTYPE_METHOD(tpl, "findAllMatches", FindAllMatches);
+  const uint32_t id = uint32_value(env, argv[0]);
 
-  constructor.Reset(isolate, tpl->GetFunction());
-  exports->Set(String::NewFromUtf8(isolate, "UnorderedBufferSet"), tpl->GetFunction());
+  FactoryInput input;
+  {
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    auto i = shared.find(id);
+    if (i != shared.end()) input.shared = i->second.lock();
+  }
+  if (!input.shared) {
+    napi_throw_error(env, NULL, "no set is shared with that id");
+    return NULL;
+  }
+  input.shareId = id;
+
+  return NewFromFactoryInput(env, addon, argv[1], input);
+}
+
+// set.createMatcher(maxNgramSize): an object to find matches in a document
+// that arrives in chunks. matcher.write(chunk) takes each Buffer or String and
+// returns the matches it completes, and matcher.end() returns the rest. Each
+// match is `{ match, offset }` (plus `id`, with ids), where offset counts
+// bytes from the start of the document. A matcher searches whatever the set
+// holds when each chunk arrives.
+napi_value
+UnorderedBufferSet::CreateMatcher(napi_env env, napi_callback_info info) {
+  napi_value arg, self;
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 1, &arg, &self));
+
+  void* obj = NULL;
+  napi_unwrap(env, self, &obj);
+
+  uint32_t maxNgramSize = uint32_value(env, arg);
+  if (maxNgramSize == 0) maxNgramSize = 1;
+
+  Matcher* matcher = new Matcher(maxNgramSize);
+  matcher->obj = static_cast<UnorderedBufferSet*>(obj);
+  napi_create_reference(env, self, 1, &matcher->set);
+
+  napi_value external, cons, ret = NULL;
+  napi_create_external(env, matcher, NULL, NULL, &external);
+  napi_get_reference_value(env, addon->matcherConstructor, &cons);
+  if (napi_new_instance(env, cons, 1, &external, &ret) != napi_ok) {
+    napi_delete_reference(env, matcher->set);
+    delete matcher;
+  }
+  return ret;
+}
+
+napi_value
+UnorderedBufferSet::MatcherNew(napi_env env, napi_callback_info info) {
+  napi_value arg, self;
+  get_args(env, info, 1, &arg, &self);
+
+  if (type_of(env, arg) != napi_external) {
+    napi_throw_type_error(env, NULL, "use set.createMatcher() to create a Matcher");
+    return NULL;
+  }
+
+  void* matcher = NULL;
+  napi_get_value_external(env, arg, &matcher);
+  napi_wrap(env, self, matcher, MatcherFinalize, NULL, NULL);
+  return self;
 }
 
 void
-UnorderedBufferSet::New(const FunctionCallbackInfo<Value>& args) {
-  Isolate* isolate = Isolate::GetCurrent();
-  HandleScope scope(isolate);
-
-  if (args.IsConstructCall()) {
-    // Invoked as constructor: `new MyObject(...)`
-    const char* s = node::Buffer::Data(args[0]);
-    const size_t len = node::Buffer::Length(args[0]);
-    UnorderedBufferSet* obj = new UnorderedBufferSet(s, len);
-    obj->Wrap(args.This());
-    args.GetReturnValue().Set(args.This());
-  } else {
-    // Invoked as plain function `MyObject(...)`, turn into construct call
-    Local<Value> argv[1] = { args[0] };
-    Local<Function> cons = Local<Function>::New(isolate, constructor);
-    args.GetReturnValue().Set(cons->NewInstance(1, argv));
+UnorderedBufferSet::MatcherFinalize(napi_env env, void* data, void* hint) {
+  Matcher* matcher = static_cast<Matcher*>(data);
+  napi_delete_reference(env, matcher->set);
+  delete matcher;
+}
+
+// Returns an Array of `{ match, offset[, id] }` Objects.
+static napi_value
+stream_matches_to_array(napi_env env, const std::vector<PooledString>& matches,
+    const std::vector<uint64_t>& offsets, const std::vector<uint32_t>* ids) {
+  const size_t size = matches.size();
+  napi_value ret;
+  napi_create_array_with_length(env, size, &ret);
+  for (size_t i = 0; i < size; i++) {
+    napi_value match, offset;
+    napi_create_object(env, &match);
+    napi_create_double(env, static_cast<double>(offsets[i]), &offset);
+    napi_set_named_property(env, match, "match", key_to_string(env, matches[i]));
+    napi_set_named_property(env, match, "offset", offset);
+    if (ids) napi_set_named_property(env, match, "id", uint32(env, (*ids)[i]));
+    napi_set_element(env, ret, i, match);
   }
+  return ret;
 }
 
-void UnorderedBufferSet::Contains(const FunctionCallbackInfo<Value>& args) {
-  Isolate* isolate = Isolate::GetCurrent();
-  HandleScope scope(isolate);
-  UnorderedBufferSet* obj = ObjectWrap::Unwrap<UnorderedBufferSet>(args.Holder());
+napi_value
+UnorderedBufferSet::MatcherWrite(napi_env env, napi_callback_info info) {
+  napi_value arg, self; // Buffer or String
+  get_args(env, info, 1, &arg, &self);
+  void* p = NULL;
+  napi_unwrap(env, self, &p);
+  Matcher* matcher = static_cast<Matcher*>(p);
 
-  bool ret = false;
+  Reading set(matcher->obj);
+  std::vector<PooledString> matches;
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> ids;
+  std::vector<uint32_t>* wantIds = set->hasIds() ? &ids : NULL;
 
-  Local<Value> arg = args[0]; // Buffer or String
+  with_bytes(env, arg, [&](const char* data, size_t len) {
+    matcher->matcher.write(*set, data, len, &matches, &offsets, wantIds);
+  });
+  return stream_matches_to_array(env, matches, offsets, wantIds);
+}
 
-  if (node::Buffer::HasInstance(arg)) {
-    // It's a buffer. Go char-by-char
-    const char* data(node::Buffer::Data(arg));
-    const size_t len(node::Buffer::Length(arg));
+napi_value
+UnorderedBufferSet::MatcherEnd(napi_env env, napi_callback_info info) {
+  napi_value self;
+  get_args(env, info, 0, NULL, &self);
+  void* p = NULL;
+  napi_unwrap(env, self, &p);
+  Matcher* matcher = static_cast<Matcher*>(p);
 
-    ret = obj->contains(data, len);
-  } else {
-    // We can convert it to utf-8. On failure, it's just an empty String.
-    String::Utf8Value argString(arg);
-    ret = obj->contains(*argString, argString.length());
+  Reading set(matcher->obj);
+  std::vector<PooledString> matches;
+  std::vector<uint64_t> offsets;
+  std::vector<uint32_t> ids;
+  std::vector<uint32_t>* wantIds = set->hasIds() ? &ids : NULL;
+
+  matcher->matcher.end(*set, &matches, &offsets, wantIds);
+  return stream_matches_to_array(env, matches, offsets, wantIds);
+}
+
+struct UnorderedBufferSet::BuildWork {
+  napi_async_work request;
+  napi_deferred deferred;
+  napi_ref buffer; // keeps the input alive while we read it
+  PreparedInput input; // borrows from buffer until BuildExecute() copies it
+  Options options;
+  AddonData* addon = NULL; // for build()
+  UnorderedBufferSet* target = NULL; // for rebuild(); ref()ed until we're done
+  BufferSet* result = NULL;
+};
+
+// UnorderedBufferSet.build(buffer[, options]): like the constructor, but
+// builds on the threadpool and returns a Promise of the set.
+napi_value
+UnorderedBufferSet::Build(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  AddonData* addon = static_cast<AddonData*>(get_args(env, info, 2, argv));
+
+  Options options;
+  if (!ParseOptions(env, argv[1], &options)) return NULL;
+
+  return QueueBuild(env, argv[0], options, addon, NULL);
+}
+
+// set.rebuild(buffer[, options]): builds a new set on the threadpool, then
+// swaps it in, and returns a Promise that resolves when that's done. Options
+// default to the ones the set was built with. Meanwhile, and after, any
+// findAllMatchesAsync() calls in progress keep reading the old set. A shared
+// set always copies: other threads can't keep a Buffer alive.
+napi_value
+UnorderedBufferSet::Rebuild(napi_env env, napi_callback_info info) {
+  napi_value argv[2];
+  UnorderedBufferSet* obj = Unwrap(env, info, 2, argv);
+
+  if (obj->attached) {
+    napi_throw_error(env, NULL, "can't rebuild an attach()ed set; rebuild() the set it was shared from");
+    return NULL;
   }
 
-  args.GetReturnValue().Set(ret);
+  Options options = obj->current()->options();
+  if (!ParseOptions(env, argv[1], &options)) return NULL;
+  if (obj->shareId) options.copy = true;
+
+  return QueueBuild(env, argv[0], options, NULL, obj);
+}
+
+// Builds a BufferSet from input on the threadpool. Then, if target is NULL,
+// resolves to a new UnorderedBufferSet, made with addon's constructor;
+// otherwise, makes it target's current version and resolves to undefined.
+napi_value
+UnorderedBufferSet::QueueBuild(napi_env env, napi_value input, const Options& options, AddonData* addon, UnorderedBufferSet* target) {
+  const char* data;
+  size_t len;
+  if (!get_bytes(env, input, &data, &len)) {
+    napi_throw_type_error(env, NULL, "input must be a Buffer");
+    return NULL;
+  }
+
+  napi_value promise, resourceName;
+  BuildWork* work = new BuildWork;
+  napi_create_promise(env, &work->deferred, &promise);
+  napi_create_reference(env, input, 1, &work->buffer);
+  work->input.memory.borrow(data, len);
+  work->options = options;
+  work->addon = addon;
+  work->target = target;
+  if (target) {
+    target->ref();
+    target->rebuilding++;
+  }
+
+  napi_create_string_utf8(env, "UnorderedBufferSet.build", NAPI_AUTO_LENGTH, &resourceName);
+  napi_create_async_work(env, NULL, resourceName, BuildExecute, BuildComplete, work, &work->request);
+  napi_queue_async_work(env, work->request);
+
+  return promise;
 }
 
 void
-UnorderedBufferSet::FindAllMatches(const FunctionCallbackInfo<Value>& args) {
-  Isolate* isolate = Isolate::GetCurrent();
-  HandleScope scope(isolate);
-  UnorderedBufferSet* obj = ObjectWrap::Unwrap<UnorderedBufferSet>(args.Holder());
+UnorderedBufferSet::BuildExecute(napi_env env, void* data) {
+  BuildWork* work = static_cast<BuildWork*>(data);
 
-  std::vector<PooledString> ret;
-  Handle<Array> retArray;
+  if (needs_input_copy(work->options)) {
+    PoolMemory& memory = work->input.memory;
+    memory.copy(memory.data(), memory.size());
+  }
 
-  Local<Value> arg = args[0]; // Buffer or String
-  uint32_t maxNgramSize = args[1]->Uint32Value();
-  if (maxNgramSize == 0) maxNgramSize = 1;
+  work->result = new BufferSet(work->input, work->options);
+}
 
-  if (node::Buffer::HasInstance(arg)) {
-    const char* data(node::Buffer::Data(arg));
-    const size_t len(node::Buffer::Length(arg));
-    ret = obj->findAllMatches(data, len, maxNgramSize);
+void
+UnorderedBufferSet::BuildComplete(napi_env env, napi_status status, void* data) {
+  BuildWork* work = static_cast<BuildWork*>(data);
 
-    // Icky copy/paste, I know
-    size_t size = ret.size();
-    retArray = Array::New(isolate, size);
-    for (size_t i = 0; i < size; i++) {
-      retArray->Set(i, String::NewFromUtf8(isolate, ret[i].start, String::NewStringType::kNormalString, ret[i].length));
-    }
+  napi_value ret = undefined(env);
+  Version* version;
+  if (work->target) {
+    version = new Version(work->result);
+    work->target->versions->publish(version);
+    work->target->rebuilding--;
+    work->target->unref();
+  } else {
+    FactoryInput built;
+    built.built = work->result;
+    ret = NewFromFactoryInput(env, work->addon, undefined(env), built);
+    void* obj = NULL;
+    napi_unwrap(env, ret, &obj);
+    version = static_cast<UnorderedBufferSet*>(obj)->versions->current();
+  }
+
+  if (work->result->isBorrowed()) {
+    napi_value buffer;
+    napi_get_reference_value(env, work->buffer, &buffer);
+    version->holdBuffer(env, buffer);
+  }
+
+  napi_resolve_deferred(env, work->deferred, ret);
+
+  napi_delete_reference(env, work->buffer);
+  napi_delete_async_work(env, work->request);
+  delete work;
+}
+
+struct UnorderedBufferSet::FindAllMatchesWork {
+  napi_async_work request;
+  napi_deferred deferred;
+  napi_ref buffer = NULL; // keeps the document alive, if it's a Buffer
+  UnorderedBufferSet* obj; // ref()ed until we're done
+  Versioned<Version>::Pin version; // what we search, even if obj is rebuilt
+  std::string utf8; // the document, if it's a String
+  const char* data;
+  size_t length;
+  uint32_t maxNgramSize;
+  uint32_t threads;
+  std::vector<PooledString> result;
+};
+
+// set.findAllMatchesAsync(doc, maxNgramSize[, { threads }]): like
+// findAllMatches(), but searches on the threadpool (and, with threads, more
+// threads of our own) and returns a Promise of the Array.
+napi_value
+UnorderedBufferSet::FindAllMatchesAsync(napi_env env, napi_callback_info info) {
+  napi_value argv[3];
+  UnorderedBufferSet* obj = Unwrap(env, info, 3, argv);
+
+  uint32_t threads;
+  if (!parse_search_options(env, argv[2], &threads)) return NULL;
+
+  napi_value promise, resourceName;
+  FindAllMatchesWork* work = new FindAllMatchesWork;
+  napi_create_promise(env, &work->deferred, &promise);
+  work->obj = obj;
+  obj->ref();
+  work->version = obj->versions->pin();
+
+  napi_value arg = argv[0]; // Buffer or String
+  work->maxNgramSize = uint32_value(env, argv[1]);
+  if (work->maxNgramSize == 0) work->maxNgramSize = 1;
+  work->threads = threads;
+
+  if (get_bytes(env, arg, &work->data, &work->length)) {
+    napi_create_reference(env, arg, 1, &work->buffer);
   } else {
     // We can convert it to utf-8. On failure, it's just an empty String.
-    String::Utf8Value argString(arg);
-    ret = obj->findAllMatches(*argString, argString.length(), maxNgramSize);
-
-    // Icky copy/paste, I know
-    size_t size = ret.size();
-    retArray = Array::New(isolate, size);
-    for (size_t i = 0; i < size; i++) {
-      retArray->Set(i, String::NewFromUtf8(isolate, ret[i].start, String::NewStringType::kNormalString, ret[i].length));
-    }
+    Utf8Value argString(env, arg);
+    work->utf8.assign(*argString, argString.length());
+    work->data = work->utf8.data();
+    work->length = work->utf8.size();
   }
 
-  args.GetReturnValue().Set(retArray);
+  napi_create_string_utf8(env, "UnorderedBufferSet.findAllMatchesAsync", NAPI_AUTO_LENGTH, &resourceName);
+  napi_create_async_work(env, NULL, resourceName, FindAllMatchesExecute, FindAllMatchesComplete, work, &work->request);
+  napi_queue_async_work(env, work->request);
+
+  return promise;
 }
 
 void
-init(Handle<Object> exports, Handle<Object> module) {
-  UnorderedBufferSet::Init(exports);
+UnorderedBufferSet::FindAllMatchesExecute(napi_env env, void* data) {
+  FindAllMatchesWork* work = static_cast<FindAllMatchesWork*>(data);
+  work->result = work->version->set->findAllMatches(work->data, work->length, work->maxNgramSize, work->threads);
 }
 
-NODE_MODULE(binding, init);
+void
+UnorderedBufferSet::FindAllMatchesComplete(napi_env env, napi_status status, void* data) {
+  FindAllMatchesWork* work = static_cast<FindAllMatchesWork*>(data);
+
+  napi_resolve_deferred(env, work->deferred, matches_to_array(env, work->result));
+
+  work->version.release();
+  work->obj->unref();
+  if (work->buffer) napi_delete_reference(env, work->buffer);
+  napi_delete_async_work(env, work->request);
+  delete work;
+}
+
+// N-API modules are context-aware, so worker_threads can require us too, and
+// one build runs on every Node version with N-API 3.
+NAPI_MODULE_INIT() {
+  return UnorderedBufferSet::Init(env, exports);
+}
@@ -0,0 +1,137 @@
+#ifndef VERSIONED_H_
+#define VERSIONED_H_
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <thread>
+
+// The current version of a T, which one thread (the writer) may replace while
+// other threads read older versions. RCU, more or less.
+//
+// Readers pin() the current version. A Pin keeps that version alive, however
+// long the reader takes and whatever the writer publishes meanwhile; the last
+// Pin of an old version deletes it. Readers never lock and never wait for the
+// writer: pin() is a few atomic adds.
+//
+// The trouble with plain reference counting is that a reader could load the
+// pointer, then the writer could drop the last reference and delete it, and
+// only then would the reader increment its count. So pin() announces itself
+// in an epoch counter first, and publish() waits until every pin() that may
+// have seen the old pointer has its reference. That wait covers a load and an
+// add, not the reads themselves, so it's short.
+//
+// The writer itself can use current() without pinning: nobody else replaces
+// or deletes it.
+template<typename T>
+class Versioned {
+  struct Version {
+    T* value;
+    std::atomic<size_t> refs;
+
+    explicit Version(T* value): value(value), refs(1) {}
+  };
+
+public:
+  class Pin {
+  public:
+    Pin(): owner(NULL), version(NULL) {}
+    Pin(Pin&& rhs): owner(rhs.owner), version(rhs.version) { rhs.version = NULL; }
+    ~Pin() { this->release(); }
+
+    Pin& operator=(Pin&& rhs) {
+      this->release();
+      this->owner = rhs.owner;
+      this->version = rhs.version;
+      rhs.version = NULL;
+      return *this;
+    }
+
+    T* get() const { return this->version->value; }
+    T* operator->() const { return this->get(); }
+
+    // Lets go early. The version may be deleted right away.
+    void release() {
+      if (this->version) this->owner->release(this->version);
+      this->version = NULL;
+    }
+
+  private:
+    const Versioned* owner;
+    Version* version;
+
+    Pin(const Versioned* owner, Version* version): owner(owner), version(version) {}
+    Pin(const Pin&);
+    Pin& operator=(const Pin&);
+
+    friend class Versioned;
+  };
+
+  // Takes ownership of initial.
+  explicit Versioned(T* initial): latest(new Version(initial)), epoch(0), nVersions(1) {
+    this->readers[0] = 0;
+    this->readers[1] = 0;
+  }
+
+  // There must be no Pins left.
+  ~Versioned() { this->release(this->latest.load()); }
+
+  // Any thread.
+  Pin pin() const {
+    while (true) {
+      const uint64_t e = this->epoch.load();
+      this->readers[e & 1]++;
+      if (this->epoch.load() == e) {
+        Version* version = this->latest.load();
+        version->refs++;
+        this->readers[e & 1]--;
+        return Pin(this, version);
+      }
+      this->readers[e & 1]--; // publish() started meanwhile; go again
+    }
+  }
+
+  // Writer only.
+  T* current() const { return this->latest.load()->value; }
+
+  // True if a Pin holds the current version: it isn't safe to modify.
+  // Writer only.
+  bool isPinned() const { return this->latest.load()->refs.load() > 1; }
+
+  // How many versions are alive, including the current one.
+  size_t size() const { return this->nVersions.load(); }
+
+  // Makes next the current version, and takes ownership of it. Readers that
+  // pinned the old one keep it until they let go. Writer only.
+  void publish(T* next) {
+    this->nVersions++;
+    Version* old = this->latest.exchange(new Version(next));
+
+    // pin()s from now on count themselves in readers[(e + 1) & 1] and see the
+    // new version. Wait out the ones in readers[e & 1], which may have loaded
+    // the old one but not counted their reference yet.
+    const uint64_t e = this->epoch.fetch_add(1);
+    while (this->readers[e & 1].load() != 0) std::this_thread::yield();
+
+    this->release(old);
+  }
+
+private:
+  std::atomic<Version*> latest;
+  std::atomic<uint64_t> epoch;
+  mutable std::atomic<size_t> readers[2]; // pin()s in progress, by epoch parity
+  mutable std::atomic<size_t> nVersions;
+
+  Versioned(const Versioned&);
+  Versioned& operator=(const Versioned&);
+
+  void release(Version* version) const {
+    if (--version->refs == 0) {
+      delete version->value;
+      delete version;
+      this->nVersions--;
+    }
+  }
+};
+
+#endif  // VERSIONED_H_
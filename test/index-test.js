@@ -1,5 +1,8 @@
 var Set = require('../index');
 var expect = require('chai').expect;
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
 
 describe('UnorderedBufferSet', function() {
   it('should return true/false from tests appropriately', function() {
@@ -18,6 +21,35 @@ describe('UnorderedBufferSet', function() {
     expect(set.contains('fooX')).to.be.false;
   });
 
+  it('should allow testing for Uint8Arrays and Strings longer than a few hundred bytes', function() {
+    var long = new Array(200).join('long ') + 'é';
+    var set = new Set(new Buffer('foo\n' + long, 'utf-8'));
+    expect(set.contains(new Uint8Array([ 0x66, 0x6f, 0x6f ]))).to.be.true;
+    expect(set.contains(new Uint8Array([ 0x66, 0x6f ]))).to.be.false;
+    expect(set.contains(long)).to.be.true;
+    expect(set.findAllMatches(long + ' foo', 200)).to.deep.eq([ long, 'foo' ]);
+  });
+
+  it('should bind contains() to its set', function() {
+    var set = new Set(new Buffer('foo', 'utf-8'));
+    var other = new Set(new Buffer('bar', 'utf-8'));
+    var contains = set.contains;
+    expect(contains('foo')).to.be.true;
+    expect([ 'foo', 'bar' ].map(set.contains)).to.deep.eq([ true, false ]);
+    expect(Set.prototype.contains.call(other, 'bar')).to.be.true;
+  });
+
+  it('should handle duplicates and sets larger than a few buckets', function() {
+    var lines = [];
+    for (var i = 0; i < 10000; i++) lines.push('word' + i);
+    var set = new Set(new Buffer(lines.join('\n') + '\nword1\nword2\n', 'utf-8'));
+    for (var i = 0; i < 10000; i++) {
+      expect(set.contains('word' + i)).to.be.true;
+    }
+    expect(set.contains('word10000')).to.be.false;
+    expect(set.contains('word')).to.be.false;
+  });
+
   it('should return a String Array of found tokens', function() {
     var set = new Set(new Buffer('foo\nbar\nbaz\nthe foo\nmoo', 'utf-8'));
 
@@ -27,4 +59,897 @@ describe('UnorderedBufferSet', function() {
     expect(set.findAllMatches('the foo went over the moo', 1))
       .to.deep.eq([ 'foo', 'moo' ]);
   });
+
+  it('should tell keys from their prefixes and extensions', function() {
+    var lines = [ 'f', 'fo', 'foo bar', 'foo', '', 'foo b' ];
+    [ {}, { threads: 3 }, { engine: 'automaton' } ].forEach(function(options) {
+      var set = new Set(new Buffer('f\nfoo bar\nfoo\n', 'utf-8'), options);
+      expect(lines.map(function(line) { return set.contains(line); }))
+        .to.deep.eq([ true, false, true, true, false, false ]);
+      expect(set.findAllMatches('fo foo bar fooo', 2)).to.deep.eq([ 'foo', 'foo bar' ]);
+    });
+  });
+
+  it('should not match a needle that runs on into the next line', function() {
+    // 'a\n1678854' happens to share a slot and a 16-bit fingerprint with 'a',
+    // and its bytes are what the pool holds from 'a' on
+    var set = new Set(new Buffer('a\n1678854\n', 'utf-8'));
+    expect(set.contains('a\n1678854')).to.be.false;
+    expect(set.findAllMatches('x a\n1678854 y', 1)).to.deep.eq([]);
+    expect(set.contains('a')).to.be.true;
+  });
+
+  it('should find long n-grams, including ones with empty tokens', function() {
+    var set = new Set(new Buffer('a b c d\nb c\nc  d\nd', 'utf-8'));
+
+    expect(set.findAllMatches('a b c d', 4))
+      .to.deep.eq([ 'b c', 'a b c d', 'd' ]);
+
+    expect(set.findAllMatches('a b c  d', 3))
+      .to.deep.eq([ 'b c', 'c  d', 'd' ]);
+  });
+
+  it('should find n-grams of every size, with and without a tokenizer', function() {
+    var keys = 'a\nb c\na b c\nc d e f\nd e f g h\nb c d e f g\ne f g h i j k\na b c d e f g h\nc d e f g h i j k\nx';
+    var doc = 'a b c d e f g h i j k a';
+    // Each size up to 8 has its own search loop; 9 and up share one
+    var expected = {
+      1: [ 'a', 'a' ],
+      2: [ 'a', 'b c', 'a' ],
+      3: [ 'a', 'a b c', 'b c', 'a' ],
+      4: [ 'a', 'a b c', 'b c', 'c d e f', 'a' ],
+      5: [ 'a', 'a b c', 'b c', 'c d e f', 'd e f g h', 'a' ],
+      6: [ 'a', 'a b c', 'b c', 'c d e f', 'b c d e f g', 'd e f g h', 'a' ],
+      7: [ 'a', 'a b c', 'b c', 'c d e f', 'b c d e f g', 'd e f g h', 'e f g h i j k', 'a' ],
+      8: [ 'a', 'a b c', 'b c', 'c d e f', 'b c d e f g', 'a b c d e f g h', 'd e f g h', 'e f g h i j k', 'a' ],
+      9: [ 'a', 'a b c', 'b c', 'c d e f', 'b c d e f g', 'a b c d e f g h', 'd e f g h', 'c d e f g h i j k', 'e f g h i j k', 'a' ],
+      12: [ 'a', 'a b c', 'b c', 'c d e f', 'b c d e f g', 'a b c d e f g h', 'd e f g h', 'c d e f g h i j k', 'e f g h i j k', 'a' ]
+    };
+
+    var plain = new Set(new Buffer(keys, 'utf-8'));
+    var folded = new Set(new Buffer(keys, 'utf-8'), { fold: 'ascii' });
+    Object.keys(expected).forEach(function(n) {
+      expect(plain.findAllMatches(doc, +n)).to.deep.eq(expected[n]);
+      expect(folded.findAllMatches(doc.toUpperCase(), +n)).to.deep.eq(expected[n].map(function(m) { return m.toUpperCase(); }));
+    });
+  });
+
+  describe('with engine: automaton', function() {
+    it('should find the same matches as the n-gram window', function() {
+      var buf = new Buffer('foo\nbar\nbaz\nthe foo\nmoo\nover the moo\nthe', 'utf-8');
+      var set = new Set(buf);
+      var automaton = new Set(buf, { engine: 'automaton' });
+      var doc = 'the foo went over the moo the foo';
+
+      [ 1, 2, 3, 10 ].forEach(function(n) {
+        expect(automaton.findAllMatches(doc, n)).to.deep.eq(set.findAllMatches(doc, n));
+      });
+    });
+
+    it('should still answer contains()', function() {
+      var set = new Set(new Buffer('foo\nthe foo', 'utf-8'), { engine: 'automaton' });
+      expect(set.contains('the foo')).to.be.true;
+      expect(set.contains('the')).to.be.false;
+    });
+
+    it('should reject unknown engines', function() {
+      expect(function() { new Set(new Buffer('foo'), { engine: 'regex' }); }).to.throw(/engine/);
+    });
+  });
+
+  it('should borrow the input Buffer with copy: false', function() {
+    var buf = new Buffer('foo\nthe foo', 'utf-8');
+    var set = new Set(buf, { copy: false });
+    expect(set.contains('the foo')).to.be.true;
+    expect(set.findAllMatches('the foo', 2)).to.deep.eq([ 'the foo', 'foo' ]);
+  });
+
+  describe('fromTextFile', function() {
+    it('should map a newline-separated file', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-test-' + process.pid + '.txt');
+      fs.writeFileSync(filename, 'foo\nbar\nthe foo\n');
+      try {
+        var set = Set.fromTextFile(filename);
+        expect(set.contains('bar')).to.be.true;
+        expect(set.contains('moo')).to.be.false;
+        expect(set.findAllMatches('the foo', 2)).to.deep.eq([ 'the foo', 'foo' ]);
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+
+    it('should throw when the file does not exist', function() {
+      expect(function() { Set.fromTextFile('/does/not/exist'); }).to.throw(/ENOENT/);
+    });
+  });
+
+  describe('serialize and fromFile', function() {
+    var filename = path.join(os.tmpdir(), 'unordered-buffer-set-test-' + process.pid + '.index');
+
+    it('should load a serialized set', function() {
+      var set = new Set(new Buffer('foo\nbar\nthe foo\nfoo', 'utf-8'));
+      set.serialize(filename);
+      try {
+        [ {}, { engine: 'automaton' } ].forEach(function(options) {
+          var loaded = Set.fromFile(filename, options);
+          expect(loaded.contains('the foo')).to.be.true;
+          expect(loaded.contains('moo')).to.be.false;
+          expect(loaded.findAllMatches('the foo bar', 2)).to.deep.eq([ 'the foo', 'foo', 'bar' ]);
+        });
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+
+    it('should write over the file a set was loaded from', function() {
+      new Set(new Buffer('foo\nbar', 'utf-8')).serialize(filename);
+      try {
+        var loaded = Set.fromFile(filename);
+        loaded.add('moo');
+        loaded.serialize(filename);
+        expect(loaded.contains('foo')).to.be.true;
+        expect(Set.fromFile(filename).contains('moo')).to.be.true;
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+
+    it('should refuse files that are not index files', function() {
+      fs.writeFileSync(filename, 'foo\nbar\n');
+      try {
+        expect(function() { Set.fromFile(filename); }).to.throw(/index file/);
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+  });
+
+  it('should build the same set on several threads', function() {
+    var lines = [];
+    for (var i = 0; i < 10000; i++) lines.push('word' + (i % 7000) + (i % 3 ? '' : ' x'));
+    var set = new Set(new Buffer(lines.join('\n'), 'utf-8'), { threads: 4 });
+    lines.forEach(function(line) {
+      expect(set.contains(line)).to.be.true;
+    });
+    expect(set.contains('word7000')).to.be.false;
+  });
+
+  it('should build with no more threads than it can use', function() {
+    [ -1, 1e6 ].forEach(function(threads) {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'), { threads: threads });
+      expect(set.contains('foo')).to.be.true;
+      expect(set.contains('bar')).to.be.true;
+      expect(set.contains('baz')).to.be.false;
+    });
+  });
+
+  describe('async', function() {
+    it('should build on the threadpool', function() {
+      return Set.build(new Buffer('foo\nthe foo', 'utf-8'))
+        .then(function(set) {
+          expect(set).to.be.instanceof(Set);
+          expect(set.contains('the foo')).to.be.true;
+          expect(set.contains('moo')).to.be.false;
+        });
+    });
+
+    it('should build with options', function() {
+      return Set.build(new Buffer('foo\nthe foo', 'utf-8'), { copy: false, engine: 'automaton' })
+        .then(function(set) {
+          expect(set.findAllMatches('the foo', 2)).to.deep.eq([ 'the foo', 'foo' ]);
+        });
+    });
+
+    it('should findAllMatchesAsync in Strings and Buffers', function() {
+      var set = new Set(new Buffer('foo\nbar\nbaz\nthe foo\nmoo', 'utf-8'));
+      return Promise.all([
+        set.findAllMatchesAsync('the foo went over the moo', 2),
+        set.findAllMatchesAsync(new Buffer('the foo went over the moo', 'utf-8'), 1)
+      ]).then(function(results) {
+        expect(results[0]).to.deep.eq([ 'the foo', 'foo', 'moo' ]);
+        expect(results[1]).to.deep.eq([ 'foo', 'moo' ]);
+      });
+    });
+  });
+
+  describe('findAllMatchOffsets', function() {
+    var set = new Set(new Buffer('foo\nbar\nbaz\nthe foo\nmoo\nçà', 'utf-8'));
+
+    it('should return byte offsets into a Buffer', function() {
+      var doc = new Buffer('the foo went over the moo', 'utf-8');
+      expect(Array.prototype.slice.call(set.findAllMatchOffsets(doc, 2)))
+        .to.deep.eq([ 0, 7, 4, 3, 22, 3 ]);
+    });
+
+    it('should return String indices into a String', function() {
+      var doc = 'çà \ud83d\ude00 the foo çà';
+      var offsets = set.findAllMatchOffsets(doc, 2);
+      expect(offsets).to.be.instanceof(Uint32Array);
+      expect(Array.prototype.slice.call(offsets)).to.deep.eq([ 0, 2, 6, 7, 10, 3, 14, 2 ]);
+      expect(doc.substr(offsets[2], offsets[3])).to.eq('the foo');
+    });
+  });
+
+  describe('batches', function() {
+    var set = new Set(new Buffer('foo\nbar\nbaz\nthe foo\nmoo', 'utf-8'));
+
+    it('should containsMany, one byte per key', function() {
+      var ret = set.containsMany(new Buffer('foo\nmoo\nfooX\n\nthe foo\n', 'utf-8'));
+      expect(ret).to.be.instanceof(Uint8Array);
+      expect(Array.prototype.slice.call(ret)).to.deep.eq([ 1, 1, 0, 0, 1 ]);
+    });
+
+    it('should containsMany with a custom separator', function() {
+      var ret = set.containsMany(new Buffer('foo,the foo,x', 'utf-8'), ',');
+      expect(Array.prototype.slice.call(ret)).to.deep.eq([ 1, 1, 0 ]);
+    });
+
+    it('should findAllMatchesMany', function() {
+      expect(set.findAllMatchesMany([ 'the foo', new Buffer('moo bar', 'utf-8'), '' ], 2))
+        .to.deep.eq([ [ 'the foo', 'foo' ], [ 'moo', 'bar' ], [] ]);
+    });
+  });
+
+  describe('tokenizer options', function() {
+    var options = { delimiters: ' \t', collapse: true, punctuation: ',.!' };
+    var set = new Set(new Buffer('foo\nthe  foo\n\tbar, baz.\n', 'utf-8'), options);
+
+    it('should canonicalize dictionary lines', function() {
+      expect(set.contains('the foo')).to.be.true;
+      expect(set.contains('the\t\tfoo!')).to.be.true;
+      expect(set.contains('bar baz')).to.be.true;
+      expect(set.contains('the bar')).to.be.false;
+    });
+
+    it('should find matches across runs of delimiters and punctuation', function() {
+      expect(set.findAllMatches('See the \t foo, bar baz!', 2))
+        .to.deep.eq([ 'the \t foo', 'foo', 'bar baz' ]);
+    });
+
+    it('should find the same matches with engine: automaton', function() {
+      var automaton = new Set(new Buffer('foo\nthe  foo\n\tbar, baz.\n', 'utf-8'),
+        { delimiters: ' \t', collapse: true, punctuation: ',.!', engine: 'automaton' });
+      expect(automaton.findAllMatches('See the \t foo, bar baz!', 2))
+        .to.deep.eq([ 'the \t foo', 'foo', 'bar baz' ]);
+    });
+
+    it('should refuse empty delimiters', function() {
+      expect(function() { new Set(new Buffer('foo'), { delimiters: '' }); }).to.throw(/delimiters/);
+    });
+
+    it('should refuse an index file built with a different tokenizer', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-tokenizer-' + process.pid + '.index');
+      set.serialize(filename);
+      try {
+        expect(Set.fromFile(filename, options).contains('the,foo')).to.be.false;
+        expect(Set.fromFile(filename, options).contains('the, foo')).to.be.true;
+        expect(function() { Set.fromFile(filename); }).to.throw(/tokenizer/);
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+  });
+
+  describe('fold', function() {
+    it('should match ASCII case-insensitively and return the original text', function() {
+      var set = new Set(new Buffer('Foo\nthe FOO\nbar', 'utf-8'), { fold: 'ascii' });
+      expect(set.contains('foo')).to.be.true;
+      expect(set.contains('THE foo')).to.be.true;
+      expect(set.findAllMatches('The Foo and BAR', 2)).to.deep.eq([ 'The Foo', 'Foo', 'BAR' ]);
+      expect(Array.prototype.slice.call(set.findAllMatchOffsets('The Foo and BAR', 2)))
+        .to.deep.eq([ 0, 7, 4, 3, 12, 3 ]);
+    });
+
+    it('should fold ASCII only with fold: ascii', function() {
+      var set = new Set(new Buffer('ÉCOLE', 'utf-8'), { fold: 'ascii' });
+      expect(set.contains('École')).to.be.true;
+      expect(set.contains('école')).to.be.false;
+    });
+
+    it('should fold Latin, Greek and Cyrillic with fold: unicode', function() {
+      var set = new Set(new Buffer('ÉCOLE\nΣΟΦΙΑ\nМОСКВА', 'utf-8'), { fold: 'unicode' });
+      expect(set.contains('école')).to.be.true;
+      expect(set.contains('σοφια')).to.be.true;
+      expect(set.contains('Москва')).to.be.true;
+      expect(set.findAllMatches('in москва', 1)).to.deep.eq([ 'москва' ]);
+    });
+
+    it('should fold long words', function() {
+      var word = new Array(400).join('Ab');
+      var set = new Set(new Buffer(word, 'utf-8'), { fold: 'ascii', engine: 'automaton' });
+      expect(set.findAllMatches('x ' + word.toUpperCase(), 1)).to.deep.eq([ word.toUpperCase() ]);
+    });
+
+    it('should reject unknown fold modes', function() {
+      expect(function() { new Set(new Buffer('foo'), { fold: 'klingon' }); }).to.throw(/fold/);
+    });
+  });
+
+  describe('hash', function() {
+    [ 'farmhash', 'fast' ].forEach(function(hash) {
+      it('should find the same keys with hash: ' + hash, function() {
+        var lines = [];
+        for (var i = 0; i < 2000; i++) lines.push('w' + i + (i % 5 ? '' : ' the longer key number ' + i));
+        [ {}, { engine: 'automaton' }, { threads: 3 }, { fold: 'ascii' } ].forEach(function(options) {
+          options.hash = hash;
+          var set = new Set(new Buffer(lines.join('\n'), 'utf-8'), options);
+          lines.forEach(function(line) { expect(set.contains(line)).to.be.true; });
+          expect(set.contains('w2000')).to.be.false;
+          expect(set.findAllMatches('x w5 the longer key number 5 w6', 6))
+            .to.deep.eq([ 'w5 the longer key number 5', 'w6' ]);
+        });
+      });
+    });
+
+    it('should refuse an index file built with a different hash', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-hash-' + process.pid + '.index');
+      new Set(new Buffer('foo\nbar', 'utf-8'), { hash: 'fast' }).serialize(filename);
+      try {
+        expect(Set.fromFile(filename, { hash: 'fast' }).contains('bar')).to.be.true;
+        expect(function() { Set.fromFile(filename); }).to.throw(/hash/);
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+
+    it('should reject unknown hashes', function() {
+      expect(function() { new Set(new Buffer('foo'), { hash: 'md5' }); }).to.throw(/hash/);
+    });
+  });
+
+  describe('compact', function() {
+    var text = 'of oxford\nuniversity of oxford\nfoo\nfoo\nford\n\nxford\nfoo';
+
+    [ true, 'suffixes' ].forEach(function(compact) {
+      it('should keep every key with compact: ' + compact, function() {
+        var set = new Set(new Buffer(text, 'utf-8'), { compact: compact, engine: 'automaton' });
+        [ 'of oxford', 'university of oxford', 'foo', 'ford', '', 'xford' ].forEach(function(key) {
+          expect(set.contains(key)).to.be.true;
+        });
+        expect(set.contains('oxford')).to.be.false;
+        expect(set.contains('rd')).to.be.false;
+        expect(set.findAllMatches('the university of oxford', 3)).to.deep.eq([ 'university of oxford', 'of oxford' ]);
+      });
+    });
+
+    it('should not depend on a borrowed Buffer', function() {
+      var buffer = new Buffer('foo\nbar\nfoo', 'utf-8');
+      var set = new Set(buffer, { compact: true, copy: false });
+      buffer.fill(0);
+      expect(set.contains('foo')).to.be.true;
+      expect(set.contains('bar')).to.be.true;
+    });
+
+    it('should write smaller index files', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-compact-' + process.pid + '.index');
+      var lines = [];
+      for (var i = 0; i < 1000; i++) lines.push('university of place ' + (i % 100), 'of place ' + (i % 100));
+      var sizes = [ false, true, 'suffixes' ].map(function(compact) {
+        new Set(new Buffer(lines.join('\n'), 'utf-8'), { compact: compact }).serialize(filename);
+        var size = fs.statSync(filename).size;
+        expect(Set.fromFile(filename).contains('of place 42')).to.be.true;
+        fs.unlinkSync(filename);
+        return size;
+      });
+      expect(sizes[1]).to.be.below(sizes[0]);
+      expect(sizes[2]).to.be.below(sizes[1]);
+    });
+  });
+
+  describe('add and delete', function() {
+    it('should add keys', function() {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'));
+      expect(set.add('baz')).to.be.true;
+      expect(set.add('foo')).to.be.false;
+      expect(set.add(new Buffer('moo cow', 'utf-8'))).to.be.true;
+      expect(set.contains('baz')).to.be.true;
+      expect(set.contains('ba')).to.be.false;
+      expect(set.findAllMatches('the baz and the moo cow', 2)).to.deep.eq([ 'baz', 'moo cow' ]);
+    });
+
+    it('should delete keys', function() {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'));
+      set.add('baz');
+      expect(set.delete('foo')).to.be.true;
+      expect(set.delete('foo')).to.be.false;
+      expect(set.delete('baz')).to.be.true;
+      expect(set.contains('foo')).to.be.false;
+      expect(set.contains('baz')).to.be.false;
+      expect(set.contains('bar')).to.be.true;
+    });
+
+    it('should add many keys', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      expect(set.addMany(new Buffer('foo\nbar\nbaz\n', 'utf-8'))).to.eq(2);
+      expect(set.addMany(new Buffer('a,b,bar', 'utf-8'), ',')).to.eq(2);
+      expect(Array.from(set.containsMany(new Buffer('foo\nbar\nbaz\na\nb\nc', 'utf-8')))).to.deep.eq([ 1, 1, 1, 1, 1, 0 ]);
+    });
+
+    it('should reject keys with newlines', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      expect(function() { set.add('a\nb'); }).to.throw(/newline/);
+      expect(function() { set.addMany(new Buffer('a\nb', 'utf-8'), ','); }).to.throw(/newline/);
+    });
+
+    it('should add keys in canonical form', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'), { delimiters: ' ,', collapse: true, fold: 'ascii' });
+      set.add('Moo,  COW');
+      expect(set.contains('moo cow')).to.be.true;
+      expect(set.findAllMatches('a MOO cow', 2)).to.deep.eq([ 'MOO cow' ]);
+    });
+
+    it('should keep changes through compact() and serialize()', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-add-' + process.pid + '.index');
+      var set = new Set(new Buffer('foo\nbar\nof oxford', 'utf-8'), { engine: 'automaton', bloom: true });
+      set.add('university of oxford');
+      set.delete('bar');
+      set.compact('suffixes');
+      expect(set.findAllMatches('the university of oxford bar', 3)).to.deep.eq([ 'university of oxford', 'of oxford' ]);
+      set.add('baz');
+      set.serialize(filename);
+      var loaded = Set.fromFile(filename);
+      expect(loaded.contains('baz')).to.be.true;
+      expect(loaded.contains('of oxford')).to.be.true;
+      expect(loaded.contains('bar')).to.be.false;
+      expect(loaded.add('moo')).to.be.true;
+      expect(loaded.delete('foo')).to.be.true;
+      expect(Set.fromFile(filename).contains('foo')).to.be.true;
+      fs.unlinkSync(filename);
+    });
+
+    it('should refuse changes while findAllMatchesAsync() runs', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      var promise = set.findAllMatchesAsync('foo', 1);
+      expect(function() { set.add('bar'); }).to.throw(/findAllMatchesAsync/);
+      return promise.then(function() {
+        expect(set.add('bar')).to.be.true;
+      });
+    });
+  });
+
+  describe('rebuild', function() {
+    it('should swap in a new set', function() {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'));
+      return set.rebuild(new Buffer('bar\nbaz', 'utf-8')).then(function(ret) {
+        expect(ret).to.be.undefined;
+        expect(set.contains('foo')).to.be.false;
+        expect(set.contains('baz')).to.be.true;
+        expect(set.findAllMatches('foo bar baz', 1)).to.deep.eq([ 'bar', 'baz' ]);
+      });
+    });
+
+    it('should keep the options unless told otherwise', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'), { fold: 'ascii' });
+      return set.rebuild(new Buffer('moo', 'utf-8'))
+        .then(function() {
+          expect(set.contains('MOO')).to.be.true;
+          return set.rebuild(new Buffer('moo', 'utf-8'), { fold: 'none' });
+        })
+        .then(function() {
+          expect(set.contains('MOO')).to.be.false;
+          expect(set.contains('moo')).to.be.true;
+        });
+    });
+
+    it('should let findAllMatchesAsync() finish with the old set', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      var before = set.findAllMatchesAsync('foo bar', 1);
+      return set.rebuild(new Buffer('bar', 'utf-8'))
+        .then(function() {
+          expect(set.add('moo')).to.be.true; // nobody's reading the new set
+          return Promise.all([ before, set.findAllMatchesAsync('foo bar moo', 1) ]);
+        })
+        .then(function(results) {
+          expect(results).to.deep.eq([ [ 'foo' ], [ 'bar', 'moo' ] ]);
+        });
+    });
+  });
+
+  describe('share', function() {
+    it('should attach to the same set', function() {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'));
+      var id = set.share();
+      expect(set.share()).to.eq(id);
+      var attached = Set.attach(id);
+      expect(attached.contains('foo')).to.be.true;
+      expect(attached.findAllMatches('foo bar baz', 1)).to.deep.eq([ 'foo', 'bar' ]);
+      expect(attached.share()).to.eq(id);
+    });
+
+    it('should show attached sets what the original rebuilds', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      var attached = Set.attach(set.share());
+      return set.rebuild(new Buffer('bar', 'utf-8')).then(function() {
+        expect(attached.contains('foo')).to.be.false;
+        expect(attached.contains('bar')).to.be.true;
+      });
+    });
+
+    it('should only change a shared set by rebuild()', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'));
+      var attached = Set.attach(set.share());
+      expect(function() { set.add('bar'); }).to.throw(/shared/);
+      expect(function() { attached.delete('foo'); }).to.throw(/attach/);
+      expect(function() { attached.rebuild(new Buffer('bar', 'utf-8')); }).to.throw(/attach/);
+    });
+
+    it('should refuse to share a set that borrows a Buffer', function() {
+      var set = new Set(new Buffer('foo', 'utf-8'), { copy: false });
+      expect(function() { set.share(); }).to.throw(/copy/);
+      expect(function() { Set.attach(123456); }).to.throw(/id/);
+    });
+
+    it('should attach from a worker_thread', function() {
+      var threads;
+      try {
+        threads = require('worker_threads');
+      } catch (e) {
+        return; // needs Node 12, or Node 10 with --experimental-worker
+      }
+
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'));
+      var code = [
+        "var threads = require('worker_threads');",
+        "var set = require(threads.workerData.module).attach(threads.workerData.id);",
+        "threads.parentPort.on('message', function(doc) {",
+        "  set.findAllMatchesAsync(doc, 1).then(function(matches) { threads.parentPort.postMessage(matches); });",
+        "});"
+      ].join('\n');
+      var worker = new threads.Worker(code, {
+        eval: true,
+        workerData: { module: path.resolve(__dirname, '../index'), id: set.share() }
+      });
+      function ask(doc) {
+        return new Promise(function(resolve, reject) {
+          worker.once('message', resolve);
+          worker.once('error', reject);
+          worker.postMessage(doc);
+        });
+      }
+
+      return ask('foo bar baz')
+        .then(function(matches) {
+          expect(matches).to.deep.eq([ 'foo', 'bar' ]);
+          return set.rebuild(new Buffer('baz', 'utf-8'));
+        })
+        .then(function() { return ask('foo bar baz'); })
+        .then(function(matches) {
+          expect(matches).to.deep.eq([ 'baz' ]);
+          return worker.terminate();
+        });
+    });
+  });
+
+  describe('bloom', function() {
+    var lines = [];
+    for (var i = 0; i < 2000; i++) lines.push('key ' + i);
+    var buffer = new Buffer(lines.join('\n'), 'utf-8');
+    var doc = 'a key 12 and key 1999 but not key 2000 nor key';
+
+    it('should not change any results with bloom: true', function() {
+      var plain = new Set(buffer);
+      var set = new Set(buffer, { bloom: true });
+      expect(set.contains('key 42')).to.be.true;
+      expect(set.contains('key 4200')).to.be.false;
+      expect(Array.from(set.containsMany(new Buffer('key 1\nkey x\nkey 1999', 'utf-8')))).to.deep.eq([ 1, 0, 1 ]);
+      expect(set.findAllMatches(doc, 2)).to.deep.eq(plain.findAllMatches(doc, 2));
+    });
+
+    it('should prefilter a set from an index file', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-bloom-' + process.pid + '.index');
+      new Set(buffer).serialize(filename);
+      var set = Set.fromFile(filename, { bloom: true });
+      fs.unlinkSync(filename);
+      expect(set.contains('key 42')).to.be.true;
+      expect(set.contains('key 4200')).to.be.false;
+    });
+
+    it('should find every key with bloom: only', function() {
+      var set = new Set(buffer, { bloom: 'only' });
+      lines.forEach(function(line) { expect(set.contains(line)).to.be.true; });
+      expect(Array.from(set.containsMany(buffer)).indexOf(0)).to.eq(-1);
+      var matches = set.findAllMatches(doc, 2);
+      [ 'key 12', 'key 1999' ].forEach(function(key) { expect(matches.indexOf(key)).not.to.eq(-1); });
+    });
+
+    it('should rarely find non-keys with bloom: only', function() {
+      var set = new Set(buffer, { bloom: 'only' });
+      var nFound = 0;
+      for (var i = 2000; i < 12000; i++) if (set.contains('key ' + i)) nFound++;
+      expect(nFound).to.be.below(300);
+    });
+
+    it('should refuse to serialize with bloom: only', function() {
+      var set = new Set(buffer, { bloom: 'only' });
+      expect(function() { set.serialize(path.join(os.tmpdir(), 'never')); }).to.throw(/serialize/);
+    });
+
+    it('should reject bloom: only with the automaton', function() {
+      expect(function() { new Set(buffer, { bloom: 'only', engine: 'automaton' }); }).to.throw(/ngram/);
+      expect(function() { new Set(buffer, { bloom: 'maybe' }); }).to.throw(/bloom/);
+      expect(function() { new Set(buffer, { bloom: true, bitsPerKey: 0 }); }).to.throw(/bitsPerKey/);
+    });
+  });
+
+  describe('ids', function() {
+    var buffer = new Buffer('foo\t42\nthe foo\t7\nbar\nfoo\t9\nmoo\tx', 'utf-8');
+
+    it('should map keys to the ids after their tabs, or to their row numbers', function() {
+      var set = new Set(buffer, { ids: true });
+      expect(set.getId('foo')).to.eq(42); // the first line wins
+      expect(set.getId('the foo')).to.eq(7);
+      expect(set.getId('bar')).to.eq(2);
+      expect(set.getId('moo')).to.eq(4);
+      expect(set.getId('cow')).to.be.undefined;
+      expect(set.contains('foo')).to.be.true;
+      expect(set.contains('foo\t42')).to.be.false;
+    });
+
+    it('should find the ids of matches', function() {
+      [ 'ngram', 'automaton' ].forEach(function(engine) {
+        var set = new Set(buffer, { ids: true, engine: engine, fold: 'ascii' });
+        expect(set.findAllMatches('THE FOO and bar', 2)).to.deep.eq([ 'THE FOO', 'FOO', 'bar' ]);
+        expect(Array.from(set.findAllMatchIds('THE FOO and bar', 2))).to.deep.eq([ 7, 42, 2 ]);
+        expect(set.findAllMatchIds('nothing', 2)).to.be.instanceof(Uint32Array);
+      });
+    });
+
+    it('should add keys with ids, and keep them through compact() and serialize()', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-ids-' + process.pid + '.index');
+      var set = new Set(buffer, { ids: true });
+      expect(set.add('cow', 12)).to.be.true;
+      expect(set.add('cow', 13)).to.be.false;
+      expect(set.addMany(new Buffer('a\t100\nb', 'utf-8'))).to.eq(2);
+      expect(set.delete('bar')).to.be.true;
+      set.compact('suffixes');
+      expect([ 'foo', 'cow', 'a', 'b', 'bar' ].map(function(k) { return set.getId(k); })).to.deep.eq([ 42, 12, 100, 1, undefined ]);
+
+      set.serialize(filename);
+      try {
+        var loaded = Set.fromFile(filename, { ids: true });
+        expect(loaded.getId('cow')).to.eq(12);
+        expect(function() { Set.fromFile(filename); }).to.throw(/ids/);
+      } finally {
+        fs.unlinkSync(filename);
+      }
+    });
+
+    it('should refuse ids where they make no sense', function() {
+      var set = new Set(buffer, { ids: true });
+      expect(function() { set.add('cow'); }).to.throw(/id/);
+      expect(function() { set.add('c\tow', 1); }).to.throw(/tab/);
+      expect(function() { new Set(buffer).getId('foo'); }).to.throw(/ids/);
+      expect(function() { new Set(buffer, { ids: true, bloom: 'only' }); }).to.throw(/bloom/);
+      expect(function() { new Set(buffer, { ids: true, delimiters: '\t' }); }).to.throw(/tab/);
+    });
+  });
+
+  describe('createMatcher', function() {
+    var set = new Set(new Buffer('foo\nthe foo\nbar baz\nmoo', 'utf-8'));
+    var doc = 'the foo drove over the moo and bar baz';
+
+    it('should find the same matches in chunks as in one piece', function() {
+      [ 1, 2, 3, 5, 40 ].forEach(function(chunkSize) {
+        var matcher = set.createMatcher(2);
+        var matches = [];
+        for (var i = 0; i < doc.length; i += chunkSize) {
+          matches = matches.concat(matcher.write(new Buffer(doc.slice(i, i + chunkSize), 'utf-8')));
+        }
+        matches = matches.concat(matcher.end());
+        expect(matches.map(function(m) { return m.match; })).to.deep.eq(set.findAllMatches(doc, 2));
+        expect(matches.map(function(m) { return m.offset; })).to.deep.eq([ 0, 4, 23, 31 ]);
+      });
+    });
+
+    it('should wait for the end of a word, and start over after end()', function() {
+      var matcher = set.createMatcher(2);
+      expect(matcher.write('the fo')).to.deep.eq([]);
+      expect(matcher.write('o')).to.deep.eq([]);
+      expect(matcher.end()).to.deep.eq([ { match: 'the foo', offset: 0 }, { match: 'foo', offset: 4 } ]);
+      expect(matcher.write('moo moo ')).to.deep.eq([ { match: 'moo', offset: 0 }, { match: 'moo', offset: 4 } ]);
+    });
+
+    it('should include ids', function() {
+      var matcher = new Set(new Buffer('foo\t42\nbar', 'utf-8'), { ids: true }).createMatcher(1);
+      expect(matcher.write('bar foo')).to.deep.eq([ { match: 'bar', offset: 0, id: 1 } ]);
+      expect(matcher.end()).to.deep.eq([ { match: 'foo', offset: 4, id: 42 } ]);
+    });
+
+    it('should stream matches', function(done) {
+      var stream = set.createMatchStream(2);
+      var matches = [];
+      stream.on('data', function(match) { matches.push(match.match + '@' + match.offset); });
+      stream.on('end', function() {
+        expect(matches).to.deep.eq([ 'the foo@0', 'foo@4', 'moo@23', 'bar baz@31' ]);
+        done();
+      });
+      stream.write(new Buffer('the foo drove over the moo and ba', 'utf-8'));
+      stream.end(new Buffer('r baz', 'utf-8'));
+    });
+  });
+
+  describe('threads', function() {
+    var set = new Set(new Buffer('foo\nthe foo\nbar baz\nmoo', 'utf-8'));
+    var words = [ 'the', 'foo', 'bar', 'baz', 'moo', 'cow' ];
+    var doc = [];
+    for (var i = 0; i < 200000; i++) doc.push(words[(i * 7) % 11 % words.length]);
+    doc = new Buffer(doc.join(' '), 'utf-8');
+
+    it('should find the same matches on several threads', function() {
+      var matches = set.findAllMatches(doc, 2);
+      expect(matches.length).to.be.above(1000);
+      expect(set.findAllMatches(doc, 2, { threads: 4 })).to.deep.eq(matches);
+      expect(Array.from(set.findAllMatchOffsets(doc, 3, { threads: 0 }))).to.deep.eq(Array.from(set.findAllMatchOffsets(doc, 3)));
+    });
+
+    it('should search on several threads asynchronously', function() {
+      return set.findAllMatchesAsync(doc, 2, { threads: 3 }).then(function(matches) {
+        expect(matches).to.deep.eq(set.findAllMatches(doc, 2));
+      });
+    });
+
+    it('should refuse options that are not an Object', function() {
+      expect(function() { set.findAllMatches(doc, 2, 4); }).to.throw(/options/);
+    });
+  });
+
+  describe('countMatches', function() {
+    var doc = 'the foo and the foo met bar and foo';
+
+    it('should count each key once, in order of first match', function() {
+      var set = new Set(new Buffer('foo\nthe foo\nbar\nmoo', 'utf-8'));
+      var result = set.countMatches(doc, 2);
+      expect(result.matches).to.deep.eq([ 'the foo', 'foo', 'bar' ]);
+      expect(Array.from(result.counts)).to.deep.eq([ 2, 3, 1 ]);
+      expect(result.ids).to.be.undefined;
+      expect(set.distinctMatches(doc, 2)).to.deep.eq([ 'the foo', 'foo', 'bar' ]);
+    });
+
+    it('should keep the top keys', function() {
+      var set = new Set(new Buffer('foo\nthe foo\nbar\nmoo', 'utf-8'));
+      var result = set.countMatches(doc, 2, { top: 2 });
+      expect(result.matches).to.deep.eq([ 'foo', 'the foo' ]);
+      expect(Array.from(result.counts)).to.deep.eq([ 3, 2 ]);
+    });
+
+    it('should count keys, not spellings', function() {
+      var set = new Set(new Buffer('the foo\nbar', 'utf-8'), { engine: 'automaton', collapse: true, fold: 'ascii', ids: true });
+      var result = set.countMatches('The foo and the  FOO', 2);
+      expect(result.matches).to.deep.eq([ 'The foo' ]);
+      expect(Array.from(result.counts)).to.deep.eq([ 2 ]);
+      expect(Array.from(result.ids)).to.deep.eq([ 0 ]);
+    });
+
+    it('should count the same on several threads', function() {
+      var set = new Set(new Buffer('foo\nthe foo\nbar baz\nmoo', 'utf-8'));
+      var words = [ 'the', 'foo', 'bar', 'baz', 'moo', 'cow' ];
+      var big = [];
+      for (var i = 0; i < 200000; i++) big.push(words[(i * 7) % 11 % words.length]);
+      big = new Buffer(big.join(' '), 'utf-8');
+
+      var result = set.countMatches(big, 2);
+      var total = Array.from(result.counts).reduce(function(a, b) { return a + b; }, 0);
+      expect(total).to.eq(set.findAllMatches(big, 2).length);
+      expect(set.countMatches(big, 2, { threads: 4 })).to.deep.eq(result);
+    });
+  });
+
+  describe('scratch space', function() {
+    var set = new Set(new Buffer('foo\nthe foo\nbar', 'utf-8'));
+    var long = new Array(200).join('the foo ') + 'bar';
+
+    it('should reuse buffers between calls without mixing up results', function() {
+      var want = set.findAllMatches(long, 2);
+      expect(want.length).to.eq(399);
+      expect(set.findAllMatches('the foo', 2)).to.deep.eq([ 'the foo', 'foo' ]);
+      expect(set.findAllMatches(long, 2)).to.deep.eq(want);
+      expect(set.findAllMatchesMany([ long, 'bar', long ], 2)).to.deep.eq([ want, [ 'bar' ], want ]);
+      expect(set.findAllMatches('bar', 2)).to.deep.eq([ 'bar' ]);
+    });
+
+    it('should search from inside a search', function() {
+      var inner = null;
+      var doc = { toString: function() { inner = set.findAllMatches(long, 1); return long + ' foo'; } };
+      var outer = set.findAllMatches(doc, 1);
+      expect(inner.length).to.eq(200);
+      expect(outer.length).to.eq(201);
+    });
+  });
+
+  describe('stats', function() {
+    it('should describe the table and its memory', function() {
+      var set = new Set(new Buffer('foo\nbar\nbaz\nthe foo', 'utf-8'));
+      var stats = set.stats();
+      expect(stats.keys).to.eq(4);
+      expect(stats.capacity).to.be.above(4);
+      expect(stats.loadFactor).to.eq(4 / stats.capacity);
+      expect(stats.probeLengths.reduce(function(a, b) { return a + b; }, 0)).to.eq(4);
+      expect(stats.maxProbeLength).to.eq(stats.probeLengths.length);
+      expect(stats.meanProbeLength).to.be.above(0.99);
+      expect(stats.memory.pool).to.eq(19);
+      expect(stats.memory.table).to.eq(stats.capacity * 8);
+      expect(stats.memory.automaton).to.eq(0);
+      expect(stats.counters).to.be.undefined;
+    });
+
+    it('should count what searches do', function() {
+      var set = new Set(new Buffer('foo\nbar\nthe foo', 'utf-8'), { counters: true });
+      expect(set.stats().counters).to.deep.eq({ searches: 0, lookups: 0, hits: 0, filtered: 0, probes: 0, bytesHashed: 0 });
+
+      set.contains('foo');
+      set.contains('moo');
+      set.findAllMatches('the foo', 2); // looks up "the", "the foo" and "foo"
+      var counters = set.stats().counters;
+      expect(counters.searches).to.eq(3);
+      expect(counters.lookups).to.eq(5);
+      expect(counters.hits).to.eq(3);
+      expect(counters.probes).to.be.above(3);
+      expect(counters.bytesHashed).to.eq(12);
+    });
+
+    it('should count lookups the Bloom filter turns away', function() {
+      var set = new Set(new Buffer('foo\nbar', 'utf-8'), { bloom: true, counters: true });
+      for (var i = 0; i < 100; i++) set.contains('moo' + i);
+      var counters = set.stats().counters;
+      expect(counters.lookups).to.eq(100);
+      expect(counters.filtered).to.be.above(90);
+      expect(set.stats().memory.bloom).to.be.above(0);
+    });
+  });
+
+  describe('perfectHash', function() {
+    var lines = [];
+    for (var i = 0; i < 2000; i++) lines.push('key ' + i, 'the key ' + (i % 500));
+    var text = lines.join('\n');
+
+    it('should find what a normal set finds, in a smaller table', function() {
+      var normal = new Set(new Buffer(text, 'utf-8'));
+      var set = new Set(new Buffer(text, 'utf-8'), { perfectHash: true });
+      var stats = set.stats();
+      expect(stats.perfectHash).to.be.true;
+      expect(normal.stats().perfectHash).to.be.false;
+      expect(stats.keys).to.eq(2500);
+      expect(stats.loadFactor).to.be.above(0.95);
+      expect(stats.probeLengths).to.deep.eq([ 2500 ]);
+      expect(stats.memory.table).to.be.below(normal.stats().memory.table);
+
+      for (var i = 0; i < 2100; i++) {
+        expect(set.contains('key ' + i)).to.eq(i < 2000);
+        expect(set.contains('the key ' + i)).to.eq(i < 500);
+      }
+      var doc = 'the key 42 and key 1999 but not key 2000 or the key 600';
+      expect(set.findAllMatches(doc, 3)).to.deep.eq(normal.findAllMatches(doc, 3));
+      expect(Array.from(set.containsMany(new Buffer('key 1\nmoo\nthe key 2', 'utf-8')))).to.deep.eq([ 1, 0, 1 ]);
+    });
+
+    it('should go back to a normal table on changes, and be perfect again after compact()', function() {
+      var set = new Set(new Buffer(text, 'utf-8'), { perfectHash: true, ids: true });
+      expect(set.add('moo', 7)).to.be.true;
+      expect(set.delete('key 3')).to.be.true;
+      expect(set.stats().perfectHash).to.be.false;
+      set.compact();
+      expect(set.stats().perfectHash).to.be.true;
+      expect(set.contains('moo')).to.be.true;
+      expect(set.contains('key 3')).to.be.false;
+      expect(set.getId('moo')).to.eq(7);
+      expect(set.getId('key 4')).to.eq(8);
+    });
+
+    it('should keep its table through serialize() and fromFile()', function() {
+      var filename = path.join(os.tmpdir(), 'unordered-buffer-set-perfect-' + process.pid + '.index');
+      new Set(new Buffer(text, 'utf-8'), { perfectHash: true, engine: 'automaton' }).serialize(filename);
+      var loaded = Set.fromFile(filename);
+      expect(loaded.stats().perfectHash).to.be.true;
+      expect(loaded.contains('the key 499')).to.be.true;
+      expect(loaded.contains('the key 500')).to.be.false;
+      expect(loaded.add('moo')).to.be.true;
+      expect(loaded.contains('the key 499')).to.be.true;
+      expect(Set.fromFile(filename).contains('moo')).to.be.false;
+      fs.unlinkSync(filename);
+    });
+
+    it('should refuse a set that keeps no keys', function() {
+      expect(function() { new Set(new Buffer(text, 'utf-8'), { perfectHash: true, bloom: 'only' }); }).to.throw(/perfectHash/);
+    });
+  });
 });